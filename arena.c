@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define HDRSIZE ((sizeof(Block) + 15) & ~(size_t)15)
+
+extern void *ecalloc(size_t nmemb, size_t size);
+
+/* function declarations */
+int arena_class(size_t size);
+
+/* function implementations */
+int
+arena_class(size_t size) {
+	int c = 0;
+
+	while((ARENA_MIN << c) < size)
+		++c;
+	return c;
+}
+
+size_t
+arena_size(size_t size) {
+	if(size > ARENA_MAX)
+		return size;
+	return ARENA_MIN << arena_class(size);
+}
+
+void *
+arena_alloc(Arena *a, size_t size) {
+	Block *b;
+	void *p;
+	int c;
+
+	if(size > ARENA_MAX) {
+		b = ecalloc(1, HDRSIZE + size);
+		b->size = size;
+		b->next = a->large;
+		if(a->large) a->large->prev = b;
+		a->large = b;
+		a->used += size;
+		a->reserved += HDRSIZE + size;
+		return (char *)b + HDRSIZE;
+	}
+
+	c = arena_class(size);
+	size = ARENA_MIN << c;
+	++a->live[c];
+	a->used += size;
+	if((p = a->free[c])) {
+		a->free[c] = *(void **)p;
+		return p;
+	}
+	b = a->blocks;
+	if(!b || b->used + size > b->size) {
+		b = ecalloc(1, HDRSIZE + ARENA_BLOCK);
+		b->size = ARENA_BLOCK;
+		b->next = a->blocks;
+		a->blocks = b;
+		a->reserved += HDRSIZE + ARENA_BLOCK;
+	}
+	p = (char *)b + HDRSIZE + b->used;
+	b->used += size;
+	return p;
+}
+
+void *
+arena_realloc(Arena *a, void *p, size_t oldsize, size_t size) {
+	void *np;
+
+	if(p && arena_size(oldsize) == arena_size(size) && size <= ARENA_MAX)
+		return p;
+	np = arena_alloc(a, size);
+	if(p) {
+		memcpy(np, p, oldsize < size ? oldsize : size);
+		arena_free(a, p, oldsize);
+	}
+	return np;
+}
+
+void
+arena_free(Arena *a, void *p, size_t size) {
+	Block *b;
+	int c;
+
+	if(!p)
+		return;
+	if(size > ARENA_MAX) {
+		b = (Block *)((char *)p - HDRSIZE);
+		if(b->prev) b->prev->next = b->next;
+		else a->large = b->next;
+		if(b->next) b->next->prev = b->prev;
+		a->used -= b->size;
+		a->reserved -= HDRSIZE + b->size;
+		free(b);
+		return;
+	}
+	c = arena_class(size);
+	*(void **)p = a->free[c];
+	a->free[c] = p;
+	--a->live[c];
+	a->used -= ARENA_MIN << c;
+}
+
+void
+arena_release(Arena *a) {
+	Block *b;
+
+	while((b = a->blocks)) {
+		a->blocks = b->next;
+		free(b);
+	}
+	while((b = a->large)) {
+		a->large = b->next;
+		free(b);
+	}
+	memset(a, 0, sizeof(Arena));
+}
+
+/* move everything from into a, from is left empty */
+void
+arena_merge(Arena *a, Arena *from) {
+	Block *b;
+	void **p;
+	int c;
+
+	if((b = from->large)) {
+		while(b->next)
+			b = b->next;
+		b->next = a->large;
+		if(a->large)
+			a->large->prev = b;
+		a->large = from->large;
+	}
+
+	/* keep carving from the current block of a */
+	if((b = from->blocks)) {
+		while(b->next)
+			b = b->next;
+		if(a->blocks) {
+			b->next = a->blocks->next;
+			a->blocks->next = from->blocks;
+		} else {
+			a->blocks = from->blocks;
+		}
+	}
+
+	for(c = 0; c < ARENA_CLASSES; c++) {
+		for(p = &from->free[c]; *p; p = *p);
+		*p = a->free[c];
+		if(from->free[c])
+			a->free[c] = from->free[c];
+		a->live[c] += from->live[c];
+	}
+	a->used += from->used;
+	a->reserved += from->reserved;
+	memset(from, 0, sizeof(Arena));
+}
+
+void
+arena_stats(Arena *a, FILE *fp) {
+	size_t large = 0, nlarge = 0;
+	Block *b;
+	int c;
+
+	fprintf(fp, "arena: %zu bytes used, %zu reserved (%.1f%%)\n",
+		a->used, a->reserved,
+		a->reserved ? 100.0 * a->used / a->reserved : 0.0);
+	for(c = 0; c < ARENA_CLASSES; c++)
+		if(a->live[c])
+			fprintf(fp, "  %5d: %zu live\n", ARENA_MIN << c, a->live[c]);
+	for(b = a->large; b; b = b->next) {
+		large += b->size;
+		++nlarge;
+	}
+	if(nlarge)
+		fprintf(fp, "  large: %zu bytes in %zu chunks\n", large, nlarge);
+}
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Size classes are powers of two from ARENA_MIN up to ARENA_MAX bytes,
+ * carved out of ARENA_BLOCK sized blocks. Bigger requests are malloc'd
+ * and tracked so that everything goes away with arena_release(). */
+#define ARENA_MIN	16
+#define ARENA_MAX	4096
+#define ARENA_CLASSES	9
+#define ARENA_BLOCK	(64 * 1024)
+
+typedef struct Block Block;
+struct Block {
+	Block *next;
+	Block *prev;
+	size_t size;
+	size_t used;
+};
+
+typedef struct {
+	Block *blocks;
+	Block *large;
+	void *free[ARENA_CLASSES];
+	size_t live[ARENA_CLASSES];
+	size_t used;
+	size_t reserved;
+} Arena;
+
+size_t arena_size(size_t size);
+void *arena_alloc(Arena *a, size_t size);
+void *arena_realloc(Arena *a, void *p, size_t oldsize, size_t size);
+void arena_free(Arena *a, void *p, size_t size);
+void arena_release(Arena *a);
+void arena_merge(Arena *a, Arena *from);
+void arena_stats(Arena *a, FILE *fp);
+
+#endif
@@ -0,0 +1,337 @@
+/* Render micro-benchmarks over synthetic corpora, run by `make bench`.
+ * Prints one tab separated record per benchmark and corpus so results
+ * can be diffed between builds. */
+#define main edo_main
+#include "edo.c"
+#undef main
+
+#define ROWS 50
+#define COLS 200
+
+typedef struct {
+	const char *name;
+	const char *unit; /* repeated to fill a line */
+	int bytes; /* per line */
+	int lines;
+} Corpus;
+
+typedef struct {
+	const char *name;
+	long (*fn)(Buffer *b, long iter);
+} Bench;
+
+/* globals */
+Corpus corpora[] = {
+	{ "ascii", "the quick brown fox jumps over the lazy dog. ", 120, 20000 },
+	{ "cjk", "\xe6\xbc\xa2\xe5\xad\x97\xe4\xbb\xae\xe5\x90\x8d\xe4\xba\xa4\xe3\x81\x98\xe3\x82\x8a\xe6\x96\x87 ", 240, 20000 },
+	{ "emoji", "\xf0\x9f\x91\xa8\xe2\x80\x8d\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x91\xa7 \xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd \xf0\x9f\x8f\xb3\xef\xb8\x8f\xe2\x80\x8d\xf0\x9f\x8c\x88 x", 240, 20000 },
+	{ "tabs", "\tif(x)\t\treturn y;\t", 120, 20000 },
+	{ "long", "lorem ipsum dolor sit amet ", 4 * 1024 * 1024, 8 }
+};
+Cell cells[COLS];
+long bench_msec = 200;
+int devnull;
+extern int compat_mode;
+extern int tui_out;
+
+extern void null_resize(int r, int c);
+extern void tui_resize(int r, int c);
+extern void tui_invalidate(void);
+
+/* function declarations */
+long nsec(void);
+Buffer *corpus_load(Corpus *c);
+long bench_render(Buffer *b, long iter);
+long bench_render_cached(Buffer *b, long iter);
+long bench_render_hscroll(Buffer *b, long iter);
+long bench_draw_view(Buffer *b, long iter);
+long bench_draw_view_hl(Buffer *b, long iter);
+long bench_hl_edit(Buffer *b, long iter);
+long bench_draw_line(Buffer *b, long iter);
+long bench_draw_line_compat(Buffer *b, long iter);
+long bench_idx2col(Buffer *b, long iter);
+long bench_search(Buffer *b, int indexed);
+long bench_search_scan(Buffer *b, long iter);
+long bench_search_index(Buffer *b, long iter);
+void run_bench(Bench *bn, Corpus *c, Buffer *b);
+void run_index(Corpus *c, Buffer *b);
+int check_allocs(Corpus *c, Buffer *b);
+
+Bench benches[] = {
+	{ "render", bench_render },
+	{ "render_cached", bench_render_cached },
+	{ "render_hscroll", bench_render_hscroll },
+	{ "draw_view", bench_draw_view },
+	{ "draw_view_hl", bench_draw_view_hl },
+	{ "hl_edit", bench_hl_edit },
+	{ "tui_draw_line", bench_draw_line },
+	{ "tui_draw_line_compat", bench_draw_line_compat },
+	{ "view_idx2col", bench_idx2col },
+	{ "search_scan", bench_search_scan },
+	{ "search_index", bench_search_index }
+};
+
+/* function implementations */
+long
+nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+Buffer *
+corpus_load(Corpus *c) {
+	Buffer *b = buffer_create(NULL);
+	Line **lines = ecalloc(c->lines, sizeof(Line *));
+	char *txt = ecalloc(1, c->bytes);
+	int ul = strlen(c->unit), len, i;
+
+	for(len = 0; len + ul <= c->bytes; len += ul)
+		memcpy(txt + len, c->unit, ul);
+	for(i = 0; i < c->lines; i++)
+		lines[i] = line_create(&b->arena, txt, len);
+	buffer_insert_lines(b, 0, lines, c->lines);
+	buffer_delete_line(b, c->lines, 1);
+	free(lines);
+	free(txt);
+	return b;
+}
+
+/* each benchmark does one operation per call and returns ops done */
+long
+bench_render(Buffer *b, long iter) {
+	ui->pool.len = 0;
+	render(cells, buffer_get_line(b, iter % b->lines_tot), NULL, 0, COLS);
+	return 1;
+}
+
+/* the cached ones stay on a screen of lines, like the cursor would */
+long
+bench_render_cached(Buffer *b, long iter) {
+	Line *l = buffer_get_line(b, iter % ROWS % b->lines_tot);
+
+	ui->pool.len = 0;
+	render(cells, l, line_marks(b, l, INT_MAX, 0), 0, COLS);
+	return 1;
+}
+
+long
+bench_render_hscroll(Buffer *b, long iter) {
+	Line *l = buffer_get_line(b, iter % ROWS % b->lines_tot);
+
+	ui->pool.len = 0;
+	render(cells, l, line_marks(b, l, INT_MAX, l->len / 2), l->len / 2, COLS);
+	return 1;
+}
+
+/* a full frame, scrolling a screen at a time */
+long
+bench_draw_view(Buffer *b, long iter) {
+	static View *v;
+
+	if(!v || v->buf != b) {
+		if(v)
+			view_destroy(v);
+		v = view_create(b);
+	}
+	v->line_idx = iter * v->screen_rows % b->lines_tot;
+	draw_view(v);
+	return v->screen_rows;
+}
+
+/* the same with the lines highlighted, lexed once per screen */
+long
+bench_draw_view_hl(Buffer *b, long iter) {
+	long n;
+
+	b->syntax = 1;
+	n = bench_draw_view(b, iter);
+	b->syntax = 0;
+	return n;
+}
+
+/* Opens a comment on the first line and closes it again, the states of
+ * a screen of lines change twice. */
+long
+bench_hl_edit(Buffer *b, long iter) {
+	Line *l = buffer_get_line(b, 0);
+
+	b->syntax = 1;
+	line_insert_text(&b->arena, l, 0, "/*", 2);
+	buffer_edit(b, 0);
+	hl_update(b, 0, ROWS - 1);
+	line_delete_char(&b->arena, l, 0, 2);
+	buffer_edit(b, 0);
+	hl_update(b, 0, ROWS - 1);
+	b->syntax = 0;
+	return 1;
+}
+
+/* a full repaint of the screen to /dev/null */
+long
+bench_draw_line(Buffer *b, long iter) {
+	static int nc[ROWS];
+	static Cell *grid;
+	int y;
+
+	if(!grid)
+		grid = ecalloc(ROWS * COLS, sizeof(Cell));
+	if(!iter) {
+		ui->pool.len = 0;
+		for(y = 0; y < ROWS; y++)
+			nc[y] = render(grid + y * COLS, buffer_get_line(b, y % b->lines_tot),
+				NULL, 0, COLS);
+	}
+	tui_invalidate();
+	for(y = 0; y < ROWS; y++)
+		ui_tui.draw_line(ui, 0, y, grid + y * COLS, nc[y]);
+	ui_tui.frame_flush();
+	return ROWS;
+}
+
+long
+bench_draw_line_compat(Buffer *b, long iter) {
+	long n;
+
+	compat_mode = 1;
+	n = bench_draw_line(b, iter);
+	compat_mode = 0;
+	return n;
+}
+
+long
+bench_idx2col(Buffer *b, long iter) {
+	static View v;
+	Line *l = buffer_get_line(b, iter % ROWS % b->lines_tot);
+
+	v.buf = b;
+	view_idx2col(&v, l, l->len);
+	return 1;
+}
+
+/* Counts the matches of a query missing from the corpus in one finder,
+ * the way a search on a file without the needle goes. With the index all
+ * blocks get ruled out, without it every line is scanned. */
+long
+bench_search(Buffer *b, int indexed) {
+	static char q[] = "needle";
+	Search *s = &b->search;
+	Finder f;
+
+	search_set(b, q, sizeof q - 1);
+	s->blocks = indexed ? index_lookup(b, q, sizeof q - 1) : NULL;
+	memset(&f, 0, sizeof(Finder));
+	f.b = b;
+	f.to = b->lines_tot;
+	s->nfinders = s->running = 1;
+	search_run(&f);
+	free(f.m);
+	search_stop(b);
+	return 1;
+}
+
+long
+bench_search_scan(Buffer *b, long iter) {
+	return bench_search(b, 0);
+}
+
+long
+bench_search_index(Buffer *b, long iter) {
+	return bench_search(b, 1);
+}
+
+void
+run_bench(Bench *bn, Corpus *c, Buffer *b) {
+	long start, elapsed, ops = 0, iter = 0;
+
+	start = nsec();
+	do {
+		ops += bn->fn(b, iter++);
+		elapsed = nsec() - start;
+	} while(elapsed < bench_msec * 1000000L);
+	printf("%s\t%s\t%ld\t%.1f\n", bn->name, c->name, ops, (double)elapsed / ops);
+}
+
+/* indexes the whole corpus once, for the search_index benchmark */
+void
+run_index(Corpus *c, Buffer *b) {
+	long start;
+
+	start = nsec();
+	index_start(b);
+	pthread_join(b->index.builder, NULL);
+	b->index.building = 0;
+	printf("index_build\t%s\t1\t%.1f\n", c->name, (double)(nsec() - start));
+}
+
+/* Frames through the TUI must not allocate once the screen, the frame
+ * buffer and the layouts have been warmed up. Walks the cursor around two
+ * screens of lines twice and counts ecalloc()/erealloc() calls in the
+ * second walk. */
+int
+check_allocs(Corpus *c, Buffer *b) {
+	UI *prev = ui;
+	View *v;
+	size_t n = 0;
+	int i, pass, frames = 200;
+
+	ui = &ui_tui;
+	v = view_create(b);
+	for(pass = 0; pass < 2; pass++) {
+		n = nallocs;
+		v->line_idx = v->col_idx = 0;
+		for(i = 0; i < frames; i++) {
+			if(i / (2 * v->screen_rows) % 2)
+				view_cursor_up(v);
+			else
+				view_cursor_down(v);
+			if(i % 3)
+				view_cursor_right(v);
+			draw_view(v);
+		}
+		n = nallocs - n;
+	}
+	printf("frame_allocs\t%s\t%d\t%.1f\n", c->name, frames, (double)n / frames);
+	view_destroy(v);
+	ui = prev;
+	return n != 0;
+}
+
+int
+main(int argc, char *argv[]) {
+	Buffer *b;
+	char *s;
+	int i, j, fail = 0;
+
+	utf8_init();
+	if((s = getenv("BENCH_MSEC")))
+		bench_msec = atol(s);
+	if((devnull = open("/dev/null", O_WRONLY)) == -1)
+		die("Cannot open /dev/null.");
+	tui_out = devnull;
+	tui_resize(ROWS, COLS);
+	null_resize(ROWS + 1, COLS);
+	ui = &ui_null;
+	ui->init();
+
+	printf("# bench\tcorpus\tops\tns_per_op\n");
+	for(i = 0; i < LENGTH(corpora); i++) {
+		if(argc > 1 && strcmp(argv[1], corpora[i].name))
+			continue;
+		b = corpus_load(&corpora[i]);
+		run_index(&corpora[i], b);
+		for(j = 0; j < LENGTH(benches); j++) {
+			ui_tui.pool.len = ui_null.pool.len = 0;
+			run_bench(&benches[j], &corpora[i], b);
+		}
+		fail |= check_allocs(&corpora[i], b);
+		buffer_destroy(b);
+	}
+	ui->exit();
+	free(ui_null.pool.data);
+	close(devnull);
+	if(fail)
+		fprintf(stderr, "%s: frames allocate in steady state\n", argv[0]);
+	return fail;
+}
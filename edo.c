@@ -1,63 +1,545 @@
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "hist.h"
 #include "utf8.h"
 #include "ui.h"
 
+#define LENGTH(X) (sizeof (X) / sizeof (X)[0])
+#define CTRL(k) ((k) & 0x1f)
+
+/* lines longer than LAYOUT_MAX bytes are not cached, they keep a
+ * checkpoint every MARK_STEP bytes instead */
+#define LAYOUT_MAX (64 * 1024)
+#define LAYOUT_SLOTS 256
+#define MARK_STEP 4096
+
+/* widths a layout keeps its wrapped rows for, one per view width */
+#define WRAP_WIDTHS 4
+
+/* redraw at least this often while input keeps coming */
+#define FRAME_MSEC 50
+
+/* lines per batch published by the loader, the first one only needs to
+ * fill a screen */
+#define LOAD_FIRST 256
+#define LOAD_BATCH (64 * 1024)
+
+/* ranges scanned in parallel at load time */
+#define LOAD_SPLIT (4 * 1024 * 1024)
+#define LOAD_THREADS 64
+
+/* larger vertical scrolls repaint the view */
+#define SCROLL_MAX(v) ((v)->screen_rows / 2)
+
+/* keystrokes remembered between two frames for latency stats */
+#define LAT_KEYS 256
+
+/* iovecs handed to a single writev() when saving, at most IOV_MAX */
+#define SAVE_IOV 1024
+
+/* default memory kept for undo, see EDO_UNDO_MAX */
+#define UNDO_MAX (64 * 1024 * 1024)
+
+/* longest query, lines per search thread at least and matches kept, past
+ * that they are only counted */
+#define SEARCH_MAX 256
+#define SEARCH_SPLIT (64 * 1024)
+#define SEARCH_THREADS 64
+#define SEARCH_KEEP (4 * 1024 * 1024)
+
+/* trigram hash buckets of the index, see EDO_INDEX */
+#define INDEX_HASH (1 << 18)
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+/* lines above the screen lexed to find the state at its top when theirs
+ * are not known, longer lines are not highlighted */
+#define HL_SYNC 256
+#define HL_LINE_MAX (64 * 1024)
+
+/* C keywords are looked up in a small open addressed table */
+#define KEYWORD_SLOTS 128
+#define KEYWORD_HASH(s, len) (((unsigned char)(s)[0] * 31 \
+	+ (unsigned char)(s)[(len) - 1] * 7 + (len)) % KEYWORD_SLOTS)
+#define HL_DIGIT(c) ((unsigned char)(c) - '0' < 10u)
+#define HL_ALPHA(c) (((unsigned char)(c) | 32) - 'a' < 26u || (c) == '_')
+
+typedef struct Line Line;
+
+/* Cluster boundaries of a line: cluster k starts at byte idx[k] and
+ * display column col[k], idx[n] and col[n] are the line length and
+ * width. Built on demand, dropped on edit.
+ *
+ * Sparse layouts of long lines only hold idx[0..n] checkpoints, about
+ * MARK_STEP bytes apart. They are extended on demand and edits only cut
+ * the ones past the edit. The column carries the tab phase.
+ *
+ * Soft wrapping caches the rows of a full layout along with it, for each
+ * width in use so views of different widths keep theirs. Long lines are
+ * simply cut every screen_cols columns. */
+typedef struct Wrap Wrap;
+struct Wrap {
+	Wrap *next;
+	int cols;
+	int nrows;
+	int rowk[]; /* first cluster of each row, rowk[nrows] is n */
+};
+
 typedef struct {
+	Line **owner; /* slot in the buffer layout ring */
+	int size;
+	int n;
+	int *idx;
+	int *col;
+	int sparse;
+	int cap; /* checkpoints room, sparse only */
+	Wrap *wrap; /* last used first, at most WRAP_WIDTHS */
+} Layout;
+
+/* Edited lines keep a gap at the last edit position: buf holds the text
+ * before gap, then gaplen unused bytes, then the rest of the text. Use
+ * line_cluster() or line_text() to read it. */
+struct Line {
 	char *buf;
-	size_t cap;
+	Layout *layout;
+	int cap; /* 0 while buf points into the file mapping */
+	int len;
+	int gap;
+	int gaplen;
+};
+
+/* Lines are kept in a treap of chunks ordered by line index. Every node
+ * holds a run of up to CHUNK_LINES lines and the number of lines in its
+ * subtree, so lookup, insert and delete are O(log n). The lexer state at
+ * the end of each line goes along with it, out of the Line header. */
+#define CHUNK_LINES 512
+typedef struct Chunk Chunk;
+struct Chunk {
+	Chunk *left;
+	Chunk *right;
+	unsigned int prio;
+	size_t count;
+	int len;
+	unsigned int block; /* in the trigram index, 0 when not indexed */
+	Line *lines[CHUNK_LINES];
+	unsigned char hl[CHUNK_LINES]; /* see hl_update() */
+};
+
+/* lines found by the loader thread, with the arena holding them */
+typedef struct Batch Batch;
+struct Batch {
+	Batch *next;
+	Arena arena;
+	size_t n;
+	Line *lines[];
+};
+
+/* Edits are logged for undo in an arena of their own. Text changes keep a
+ * copy of their bytes and runs of typing grow a single change. Removed
+ * lines are not copied: the chunks holding them move out of the buffer
+ * into the change and back, so undoing a range costs O(log n) plus the
+ * chunks at its ends. */
+enum { UNDO_INSERT, UNDO_DELETE, UNDO_LINES_IN, UNDO_LINES_OUT };
+
+typedef struct Change Change;
+struct Change {
+	Change *prev;
+	Change *next;
+	int type;
+	int cont; /* undone along with the previous change */
+	int line;
+	int col;
+	int len; /* bytes of text or number of lines */
+	int cap; /* text room */
+	Chunk *lines; /* the lines while they are out of the buffer */
+	size_t held; /* memory of those lines */
+	char text[];
+};
+
+typedef struct {
+	Arena arena;
+	Change *head; /* oldest */
+	Change *tail;
+	Change *cur; /* last change done, NULL when all are undone */
+	size_t size; /* changes plus the lines they hold */
+	size_t max; /* 0 while not logging */
+	int group; /* the next change starts a new group */
+	int typing; /* the tail change is still being typed */
+} Undo;
+
+typedef struct {
+	int line;
+	int col;
+} Match;
+
+/* The last query and its matches in buffer order. Finder threads fill
+ * them in the background once the file is loaded, an edit stops them and
+ * they start over. Once all the matches are known they follow the edits,
+ * only the lines changed are searched again. A longer query only filters
+ * the matches of the previous one. */
+typedef struct Finder Finder;
+typedef struct {
+	char query[SEARCH_MAX];
 	int len;
-} Line;
+	Match *m;
+	size_t n;
+	size_t cap;
+	size_t count; /* matches in the buffer, m holds them all if n == count */
+	int done;
+	Finder *finders;
+	int nfinders;
+	int running; /* finders still going, under the buffer lock */
+	int cancel; /* atomic */
+	unsigned long *blocks; /* that may hold the query, NULL for all */
+	int stale_from, stale_to; /* lines to search again, none if to < from */
+} Search;
+
+/* Trigram index of the lines. Each indexed chunk is a block with its own
+ * number and every trigram (hashed) lists the blocks holding it, delta
+ * coded. Edits take the number off the chunks they change, those are
+ * searched in full until the builder thread gets to them again. The lists
+ * keep the numbers taken off until half of them are, then the index is
+ * built over. */
+typedef struct {
+	unsigned char *data;
+	unsigned int len;
+	unsigned int cap;
+	unsigned int last; /* block added last */
+} Posting;
+
+typedef struct {
+	Posting *post; /* INDEX_HASH of them */
+	unsigned int nblocks; /* numbers given out so far */
+	unsigned int stale; /* of them no chunk holds anymore */
+	size_t bytes; /* posting data */
+	pthread_t builder;
+	int building; /* builder not joined yet */
+	int running; /* under the buffer lock */
+	int cancel; /* atomic */
+	int done; /* every chunk has a number */
+} Index;
+
+/* byte ranges of a line drawn with extra cell flags or an attribute */
+typedef struct {
+	int start;
+	int end;
+	int flags;
+	int attr;
+} Span;
+
+/* Lexer states at the end of a line. HL_DIRTY is added to the state of a
+ * line when its text or the state before it may have changed, new lines
+ * start out as HL_UNKNOWN. */
+enum { HL_NORMAL, HL_COMMENT, HL_STRING, HL_PREPROC };
+#define HL_DIRTY 0x80
+#define HL_UNKNOWN 0xff
+
+typedef struct {
+	const char *word;
+	int attr;
+} Keyword;
 
+typedef struct View View;
+
+/* A file loaded once and shown by any number of views. Layouts are kept
+ * with the lines, so every view reuses them. */
 typedef struct {
-	Line **lines;
+	Arena arena; /* Line headers and text */
+	Chunk *root;
 	char *file_name;
-	int file_size;
-	int lines_cap;
+	char *map;
+	size_t map_size;
+	size_t file_size;
 	size_t lines_tot;
-	//int ref_count;
+	View *views; /* showing it, linked through next */
+	int ref_count; /* its views and whoever created it */
+	int syntax; /* highlighted as C */
+	Line *layouts[LAYOUT_SLOTS]; /* lines holding a layout */
+	int layout_next;
+	pthread_t loader;
+	int loading_thread; /* loader not joined yet */
+	size_t load_shown; /* load_pos as of the last buffer_poll() */
+	size_t load_next; /* where the next batch goes */
+	pthread_mutex_t lock; /* guards the fields below */
+	pthread_cond_t cond;
+	Batch *batches; /* waiting for buffer_poll() */
+	Batch **batches_tail;
+	size_t load_pos; /* bytes scanned so far */
+	int loading;
+	int load_cancel; /* atomic, not under the lock */
+	int load_woken;
+	Undo undo;
+	Search search;
+	Index index;
 } Buffer;
 
+/* a range of the mapping split into lines by one thread */
+typedef struct {
+	Buffer *b;
+	pthread_t tid;
+	char *start, *end;
+	int direct; /* publish batches as soon as they fill */
+	Batch *batches, **tail;
+} Scan;
+
+/* a range of lines searched by one thread */
+struct Finder {
+	Buffer *b;
+	pthread_t tid;
+	size_t from, to;
+	Match *m;
+	size_t n;
+	size_t cap;
+	size_t count;
+};
+
+/* a row of a view in the frame being drawn */
 typedef struct {
+	Line *line; /* NULL past the end */
+	int sub; /* row of the line when wrapping */
+	int state; /* of the lexer at the start of the line */
+	int draw;
+} ViewRow;
+
+struct View {
 	Buffer *buf;
+	View *next; /* the other views of buf */
 	int line_idx;
 	int col_idx;
 	int row_off;
+	int row_sub; /* first visible row of line row_off when wrapping */
 	int col_off;
-	int screen_rows;
+	int x; /* top left corner on the screen */
+	int y;
+	int screen_rows; /* the status line goes below */
 	int screen_cols;
+	int dmg_from; /* lines changed since the last redraw */
+	int dmg_to;
+	int drawn_row_off; /* what the screen currently shows */
+	int drawn_row_sub;
+	int drawn_col_off;
+	int redraw;
+	int wrap; /* soft wrap lines instead of scrolling horizontally */
+	ViewRow *rows;
 	//int pref_col;
-} View;
+};
+
+/* Splits of the screen. Leaves hold a view, the others two frames side by
+ * side (vertical) or one above the other. */
+typedef struct Frame Frame;
+struct Frame {
+	Frame *parent;
+	Frame *kid[2];
+	int vertical;
+	View *view;
+};
 
 /* variables */
+unsigned int chunk_seed = 2463534242;
+int *layout_idx, *layout_col;
+int layout_cap;
+Span *spans; /* of the line being rendered */
+int nspans, spans_cap;
+Span *attrs; /* same, from the lexer */
+int nattrs, attrs_cap;
+char *hl_text; /* copy of a line with a gap being lexed */
+int hl_text_cap;
+Keyword keywords[] = {
+	{ "_Bool", ATTR_TYPE }, { "auto", ATTR_KEYWORD }, { "break", ATTR_KEYWORD },
+	{ "case", ATTR_KEYWORD }, { "char", ATTR_TYPE }, { "const", ATTR_KEYWORD },
+	{ "continue", ATTR_KEYWORD }, { "default", ATTR_KEYWORD }, { "do", ATTR_KEYWORD },
+	{ "double", ATTR_TYPE }, { "else", ATTR_KEYWORD }, { "enum", ATTR_KEYWORD },
+	{ "extern", ATTR_KEYWORD }, { "float", ATTR_TYPE }, { "for", ATTR_KEYWORD },
+	{ "goto", ATTR_KEYWORD }, { "if", ATTR_KEYWORD }, { "inline", ATTR_KEYWORD },
+	{ "int", ATTR_TYPE }, { "int16_t", ATTR_TYPE }, { "int32_t", ATTR_TYPE },
+	{ "int64_t", ATTR_TYPE }, { "int8_t", ATTR_TYPE }, { "long", ATTR_TYPE },
+	{ "register", ATTR_KEYWORD }, { "restrict", ATTR_KEYWORD }, { "return", ATTR_KEYWORD },
+	{ "short", ATTR_TYPE }, { "signed", ATTR_TYPE }, { "size_t", ATTR_TYPE },
+	{ "sizeof", ATTR_KEYWORD }, { "ssize_t", ATTR_TYPE }, { "static", ATTR_KEYWORD },
+	{ "struct", ATTR_KEYWORD }, { "switch", ATTR_KEYWORD }, { "typedef", ATTR_KEYWORD },
+	{ "uint16_t", ATTR_TYPE }, { "uint32_t", ATTR_TYPE }, { "uint64_t", ATTR_TYPE },
+	{ "uint8_t", ATTR_TYPE }, { "union", ATTR_KEYWORD }, { "unsigned", ATTR_TYPE },
+	{ "void", ATTR_TYPE }, { "volatile", ATTR_KEYWORD }, { "while", ATTR_KEYWORD }
+};
+Keyword *keyword_slots[KEYWORD_SLOTS];
+int keywords_hashed;
+const unsigned char hl_stops[256] = { ['/'] = 1, ['"'] = 1, ['\''] = 1 };
+char *hl_exts[] = { ".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp" };
+/* latency stages, per event or per frame */
+enum {
+	LAT_KEY, /* from next_event() returning to the frame being written */
+	LAT_EVENT,
+	LAT_SCROLL,
+	LAT_RENDER,
+	LAT_DRAW,
+	LAT_FLUSH,
+	LAT_BYTES,
+	LAT_LAST
+};
+
 int running = 1;
+size_t undo_max = UNDO_MAX;
+int index_on; /* see EDO_INDEX */
+size_t nallocs; /* ecalloc() and erealloc() calls */
+char msg[256];
+char *lat_file; /* latency stats are kept if set */
+volatile sig_atomic_t lat_dump;
+Hist lat[LAT_LAST] = {
+	{ "key" }, { "event" }, { "scroll" }, { "render" },
+	{ "draw_line" }, { "flush" }, { "bytes" }
+};
+uint64_t lat_frame[LAT_LAST]; /* stage time summed over the frame */
+uint64_t lat_keys[LAT_KEYS];
+int lat_nkeys;
+int searching; /* keys go to the query */
+int search_line, search_col; /* where the search started */
+Frame *frames; /* the whole screen */
+View **views; /* leaves of frames, in screen order */
+int nviews, views_cap;
+Cell *row_cells; /* a screen row being put together */
+int row_cells_cap;
+int window_key; /* the next key is a window command */
 View *vcur;
 UI *ui;
 
 /* function declarations */
 void die(const char *fmt, ...);
+long now_msec(void);
+uint64_t now_nsec(void);
+uint64_t lat_start(void);
+void lat_stop(int stage, uint64_t t);
+void lat_event(uint64_t t);
+void lat_frame_done(size_t bytes);
+void lat_report(void);
+void lat_signal(int sig);
 void *ecalloc(size_t nmemb, size_t size);
 void *erealloc(void *p, size_t size);
-void insert_data(char *dst, char *txt, int txtlen, int len);
-void delete_char(char *dst, int count, int len);
-void line_insert_text(Line *line, size_t index, char *txt, int len);
-void line_delete_char(Line *line, int index, int count);
-Line *line_create(char *content);
-void line_destroy(Line *l);
+void line_insert_text(Arena *a, Line *line, size_t index, char *txt, int len);
+void line_delete_char(Arena *a, Line *line, int index, int count);
+void line_own(Arena *a, Line *l, size_t cap);
+void line_move_gap(Line *l, int index);
+char *line_text(Line *l);
+char *line_bytes(Line *l, int index, int len);
+char *line_span(Line *l, int index, int *len);
+char *line_cluster(Line *l, int index, int *len);
+int line_run(Line *l, int index, int max);
+Layout *line_layout(Buffer *b, Line *l);
+void layout_reserve(int n);
+void line_drop_layout(Arena *a, Line *l);
+void wrap_free(Arena *a, Wrap *w);
+void layout_cut(Arena *a, Line *l, int index);
+Layout *layout_slot(Buffer *b, Line *l, size_t size);
+Layout *line_marks(Buffer *b, Line *l, int idx, int col);
+int marks_find(Layout *lo, int index);
+Layout *line_wrap(View *v, Line *l);
+int line_rows(View *v, Line *l);
+int line_row(View *v, Line *l, int r, int *w);
+int line_row_at(View *v, Line *l, int x);
+int layout_find(Layout *lo, int index);
+int layout_find_col(Layout *lo, int col);
+Line *line_create(Arena *a, char *txt, int len);
+Line *line_create_ref(Arena *a, char *p, int len);
+void line_destroy(Arena *a, Line *l);
+Chunk *chunk_create(void);
+void chunk_free(Chunk *c, Arena *a);
+size_t chunk_count(Chunk *c);
+void chunk_update(Chunk *c);
+Chunk *chunk_merge(Chunk *a, Chunk *b);
+void chunk_split(Chunk *c, size_t idx, Chunk **l, Chunk **r);
+Chunk *chunk_find(Chunk *c, size_t *idx);
+int chunk_insert(Chunk *c, size_t idx, Line *line);
+Chunk *chunk_drop_first(Chunk *c, int len);
+Chunk *chunk_build(Line **lines, size_t n);
+size_t chunk_bytes(Chunk *c);
+void buffer_splice(Buffer *b, int index, Chunk *m);
+Chunk *buffer_cut(Buffer *b, int index, int count);
 void buffer_insert_line(Buffer *b, int index, Line *line);
+void buffer_insert_lines(Buffer *b, int index, Line **lines, size_t n);
 void buffer_delete_line(Buffer *b, int index, int count);
+void buffer_coalesce(Buffer *b, size_t index);
+void buffer_insert_text(Buffer *b, int index, int col, char *txt, int len);
+void buffer_delete_text(Buffer *b, int index, int col, int count);
+void buffer_insert_data(Buffer *b, int *index, int *col, char *txt, size_t len);
+void buffer_damage(Buffer *b, int from, int to);
+void buffer_move(Buffer *b, int index, int n);
+void buffer_edit(Buffer *b, int index);
+Change *undo_add(Buffer *b, int type, int line, int col, int len);
+void undo_insert(Buffer *b, int line, int col, char *txt, int len);
+void undo_delete(Buffer *b, int line, int col, int len);
+void undo_lines(Buffer *b, int type, int index, int n, Chunk *m);
+void undo_free(Buffer *b, Change *c);
+void undo_trim(Buffer *b);
+void undo_seal(Buffer *b);
+void undo_apply(Buffer *b, Change *c, int redo);
+int buffer_undo(Buffer *b, int *line, int *col);
+int buffer_redo(Buffer *b, int *line, int *col);
+void undo_release(Buffer *b);
+unsigned char *hl_state(Buffer *b, int index);
+int hl_start(Buffer *b, int index);
+int hl_word(char *s, int len);
+void hl_span(int start, int end, int attr, int from, int to);
+int hl_end(char *s, int len, int i, int quote);
+int hl_lex(char *s, int len, int state, int from, int to);
+int hl_line(Line *l, int state, int from, int to);
+void hl_update(Buffer *b, int from, int to);
+void line_highlight(Buffer *b, Line *l, int state, int x, int w);
+int line_find(Line *l, int from, int end, char *q, int qlen);
+int line_match(Line *l, int col, char *q, int qlen);
+void line_matches(Buffer *b, Line *l, int x, int w);
+void search_set(Buffer *b, char *q, int len);
+void search_start(Buffer *b);
+void *search_run(void *arg);
+void search_stop(Buffer *b);
+void search_poll(Buffer *b);
+size_t search_at(Search *s, int line);
+void search_touch(Buffer *b, int from, int to);
+void search_move(Buffer *b, int index, int n);
+void search_update(Buffer *b);
+int search_next(Buffer *b, int *line, int *col);
+void search_key(View *v, int key);
+unsigned int trigram_hash(unsigned int t);
+void posting_add(Index *x, Posting *p, unsigned int block);
+int index_chunk(Buffer *b, Chunk *c, unsigned char *seen, unsigned int *hs);
+int index_walk(Buffer *b, Chunk *c, unsigned char *seen, unsigned int *hs);
+unsigned int index_count(Chunk *c);
+void index_clear(Chunk *c);
+void *index_run(void *arg);
+void index_start(Buffer *b);
+void index_stop(Buffer *b);
+void index_poll(Buffer *b);
+unsigned long *index_lookup(Buffer *b, char *q, int len);
+void index_release(Buffer *b);
 int buffer_load_file(Buffer *b);
+void *buffer_loader(void *arg);
+void *buffer_scan(void *arg);
+void buffer_publish(Buffer *b, Batch *bt, size_t pos, int done);
+void buffer_poll(Buffer *b);
+void buffer_wait_load(Buffer *b);
+int buffer_save(Buffer *b);
+void iov_add(struct iovec *iov, int *n, char *s, size_t len);
+int write_iov(int fd, struct iovec *iov, int n, int *calls);
 Line *buffer_get_line(Buffer *b, int index);
+int buffer_get_lines(Buffer *b, int index, Line ***lines);
 Buffer *buffer_create(char *fn);
 void buffer_destroy(Buffer *b);
 View *view_create(Buffer *b);
 void view_destroy(View *v);
+void view_resize(View *v, int x, int y, int rows, int cols);
 void view_cursor_fix(View *v);
 void view_cursor_hfix(View *v);
 void view_cursor_vfix(View *v);
@@ -67,165 +549,2493 @@ void view_cursor_up(View *v);
 void view_cursor_down(View *v);
 int view_idx2col(View *v, Line *line, int idx);
 void view_scroll_fix(View *v);
+int view_rows_between(View *v, int l1, int s1, int l2, int s2, int max);
+void view_anchor_above(View *v, int line, int sub, int n);
+int view_scroll_delta(View *v);
 int measure_span(char *s, int len, int start_x);
-int render(Cell *cells, char *buf, int buflen, int xoff, int cols);
+int render(Cell *cells, Line *l, Layout *lo, int xoff, int cols);
 char *cell_get_text(Cell *cell, char *pool_base);
 void view_place_cursor(View *v);
+void view_update(View *v);
+void view_prepare(View *v, int scroll);
+int view_render_row(View *v, int y, Cell *cells);
+void draw_views(View **vs, int n);
 void draw_view(View *v);
+int draw_status(View *v, Cell *cells);
+Frame *frame_create(View *v);
+Frame *frame_find(Frame *f, View *v);
+void frame_free(Frame *f);
+void frame_layout(Frame *f, int x, int y, int rows, int cols);
+void layout(void);
+int window_split(View *v, int vertical);
+int window_close(View *v);
+void window_cmd(int key);
+void set_msg(const char *fmt, ...);
 void textpool_ensure_cap(TextPool *pool, int len);
 int textpool_insert(TextPool *pool, char *s, int len);
 
-/* function implementations */
-void
-die(const char *fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
-	va_end(ap);
+/* function implementations */
+void
+die(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	if (fmt[0] && fmt[strlen(fmt)-1] == ':') {
+		fputc(' ', stderr);
+		perror(NULL);
+	} else {
+		fputc('\n', stderr);
+	}
+	exit(0);
+}
+
+long
+now_msec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+now_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t
+lat_start(void) {
+	return lat_file ? now_nsec() : 0;
+}
+
+void
+lat_stop(int stage, uint64_t t) {
+	if(lat_file)
+		lat_frame[stage] += now_nsec() - t;
+}
+
+/* an event handled since t, it waits for the next frame */
+void
+lat_event(uint64_t t) {
+	if(!lat_file)
+		return;
+	hist_add(&lat[LAT_EVENT], now_nsec() - t);
+	if(lat_nkeys < LAT_KEYS)
+		lat_keys[lat_nkeys++] = t;
+}
+
+void
+lat_frame_done(size_t bytes) {
+	uint64_t t;
+	int i;
+
+	if(!lat_file)
+		return;
+	t = now_nsec();
+	for(i = 0; i < lat_nkeys; i++)
+		hist_add(&lat[LAT_KEY], t - lat_keys[i]);
+	lat_nkeys = 0;
+	for(i = LAT_SCROLL; i <= LAT_FLUSH; i++) {
+		hist_add(&lat[i], lat_frame[i]);
+		lat_frame[i] = 0;
+	}
+	hist_add(&lat[LAT_BYTES], bytes);
+}
+
+void
+lat_report(void) {
+	FILE *fp;
+	int i;
+
+	if(!(fp = fopen(lat_file, "w")))
+		return;
+	fprintf(fp, "%-10s %8s %10s %10s %10s\n", "# stage", "count", "p50", "p99", "max");
+	for(i = 0; i < LAT_BYTES; i++)
+		hist_print(&lat[i], fp, 1000.0); /* usec */
+	hist_print(&lat[LAT_BYTES], fp, 1.0);
+	fclose(fp);
+}
+
+/* SIGUSR1 asks for the latency report */
+void
+lat_signal(int sig) {
+	lat_dump = 1;
+	ui->wakeup();
+}
+
+void *
+ecalloc(size_t nmemb, size_t size) {
+	void *p;
+
+	if(!(p = calloc(nmemb, size)))
+		die("Cannot allocate memory.");
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED); /* finders allocate too */
+	return p;
+}
+
+void *
+erealloc(void *p, size_t size) {
+	if(!(p = realloc(p, size)))
+		die("Cannot reallocate memory.");
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return p;
+}
+
+void
+line_insert_text(Arena *a, Line *line, size_t index, char *txt, int len) {
+	size_t newlen = line->len + len;
+
+	assert(index >= 0 && index <= line->len);
+	layout_cut(a, line, index);
+	if(len > line->gaplen) {
+		size_t cap = line->cap ? line->cap * 2 : 16;
+
+		while(cap < newlen) cap *= 2;
+		line_own(a, line, cap);
+	}
+	line_move_gap(line, index);
+	memcpy(line->buf + line->gap, txt, len);
+	line->gap += len;
+	line->gaplen -= len;
+	line->len = newlen;
+}
+
+void
+line_delete_char(Arena *a, Line *line, int index, int count) {
+	layout_cut(a, line, index);
+	if(!line->cap && line->len)
+		line_own(a, line, line->len);
+	line_move_gap(line, index);
+	line->gaplen += count;
+	line->len -= count;
+}
+
+/* grow the line buffer to cap bytes, copying it out of the file mapping
+ * the first time a mapped line gets modified. */
+void
+line_own(Arena *a, Line *l, size_t cap) {
+	char *buf;
+	int tail = l->len - l->gap;
+
+	cap = arena_size(cap);
+	if(l->cap) {
+		l->buf = arena_realloc(a, l->buf, l->cap, cap);
+		memmove(l->buf + cap - tail, l->buf + l->gap + l->gaplen, tail);
+	} else {
+		buf = arena_alloc(a, cap);
+		if(l->len) memcpy(buf, l->buf, l->len);
+		l->buf = buf;
+		l->gap = l->len;
+	}
+	l->cap = cap;
+	l->gaplen = cap - l->len;
+}
+
+void
+line_move_gap(Line *l, int index) {
+	if(index < l->gap)
+		memmove(l->buf + index + l->gaplen, l->buf + index, l->gap - index);
+	else if(index > l->gap)
+		memmove(l->buf + l->gap, l->buf + l->gap + l->gaplen, index - l->gap);
+	l->gap = index;
+}
+
+/* contiguous text of the whole line, closes the gap */
+char *
+line_text(Line *l) {
+	if(l->gap != l->len)
+		line_move_gap(l, l->len);
+	return l->buf;
+}
+
+/* contiguous copy of len bytes at index if they straddle the gap, the
+ * line is left alone as other threads may be reading it */
+char *
+line_bytes(Line *l, int index, int len) {
+	static char *tmp;
+	static int cap;
+	int pre;
+
+	if(index >= l->gap)
+		return l->buf + l->gaplen + index;
+	if(index + len <= l->gap)
+		return l->buf + index;
+	if(len > cap)
+		tmp = erealloc(tmp, cap = len > 64 ? len : 64);
+	pre = l->gap - index;
+	memcpy(tmp, l->buf + index, pre);
+	memcpy(tmp + pre, l->buf + l->gap + l->gaplen, len - pre);
+	return tmp;
+}
+
+/* text at index, len is set to the bytes available up to the gap */
+char *
+line_span(Line *l, int index, int *len) {
+	if(index >= l->gap) {
+		*len = l->len - index;
+		return l->buf + l->gaplen + index;
+	}
+	*len = l->gap - index;
+	return l->buf + index;
+}
+
+/* number of one-byte one-cell clusters at index, up to max */
+int
+line_run(Line *l, int index, int max) {
+	int len, n;
+	char *p;
+
+	if(max <= 0)
+		return 0;
+	p = line_span(l, index, &len);
+	if(len > max + 1)
+		len = max + 1;
+	n = ui->text_run(p, len);
+
+	/* the byte before the gap may join what follows it */
+	if(n == len && index + len < l->len)
+		--n;
+	return n < max ? n : max;
+}
+
+/* return the cluster starting at index and set len to its size */
+char *
+line_cluster(Line *l, int index, int *len) {
+	static char tmp[64];
+	char *p;
+	int n, pre;
+
+	if(index >= l->gap) {
+		p = l->buf + l->gaplen + index;
+		*len = ui->text_len(p, l->len - index);
+		return p;
+	}
+	p = l->buf + index;
+	n = l->gap - index;
+	*len = ui->text_len(p, n);
+	if(*len < n || l->gap == l->len || n >= sizeof tmp)
+		return p;
+
+	/* the cluster reaches the gap, segment a copy joining both sides */
+	pre = n;
+	n = l->len - index < sizeof tmp ? l->len - index : sizeof tmp;
+	memcpy(tmp, p, pre);
+	memcpy(tmp + pre, l->buf + l->gap + l->gaplen, n - pre);
+	*len = ui->text_len(tmp, n);
+	return tmp;
+}
+
+Layout *
+line_layout(Buffer *b, Line *l) {
+	Layout *lo;
+	int n = 0, i = 0, x = 0, len, run;
+	char *p;
+
+	if(l->len > LAYOUT_MAX)
+		return NULL;
+	if(l->layout && !l->layout->sparse)
+		return l->layout;
+	line_drop_layout(&b->arena, l);
+
+	while(i < l->len) {
+		run = line_run(l, i, l->len - i);
+		layout_reserve(n + run + 2);
+		if(run) {
+			for(len = 0; len < run; len++, n++) {
+				layout_idx[n] = i + len;
+				layout_col[n] = x + len;
+			}
+			i += run;
+			x += run;
+			continue;
+		}
+		layout_idx[n] = i;
+		layout_col[n] = x;
+		p = line_cluster(l, i, &len);
+		x += ui->text_width(p, len, x);
+		i += len;
+		++n;
+	}
+	layout_reserve(n + 1);
+	layout_idx[n] = i;
+	layout_col[n] = x;
+
+	lo = layout_slot(b, l, sizeof(Layout) + 2 * sizeof(int) * (n + 1));
+	lo->n = n;
+	lo->idx = (int *)(lo + 1);
+	lo->col = lo->idx + n + 1;
+	memcpy(lo->idx, layout_idx, sizeof(int) * (n + 1));
+	memcpy(lo->col, layout_col, sizeof(int) * (n + 1));
+	return lo;
+}
+
+/* allocate a layout for l in the oldest slot of the ring */
+Layout *
+layout_slot(Buffer *b, Line *l, size_t size) {
+	Layout *lo;
+	Line **slot;
+
+	slot = &b->layouts[b->layout_next];
+	b->layout_next = (b->layout_next + 1) % LAYOUT_SLOTS;
+	if(*slot)
+		line_drop_layout(&b->arena, *slot);
+
+	lo = arena_alloc(&b->arena, size);
+	memset(lo, 0, sizeof(Layout));
+	lo->owner = slot;
+	lo->size = size;
+	*slot = l;
+	l->layout = lo;
+	return lo;
+}
+
+/* The layout to look up idx or col in: the full one when the line has it,
+ * else checkpoints extended until one lies past idx or col. */
+Layout *
+line_marks(Buffer *b, Line *l, int idx, int col) {
+	Layout *lo;
+	int *a, i, x, len, end;
+	char *p;
+
+	if(l->len <= LAYOUT_MAX)
+		return line_layout(b, l);
+	if(!(lo = l->layout)) {
+		lo = layout_slot(b, l, sizeof(Layout));
+		lo->sparse = 1;
+		lo->cap = 64;
+		lo->idx = arena_alloc(&b->arena, 2 * sizeof(int) * lo->cap);
+		lo->col = lo->idx + lo->cap;
+		lo->idx[0] = lo->col[0] = 0;
+	}
+
+	i = lo->idx[lo->n];
+	x = lo->col[lo->n];
+	while(i < l->len && i <= idx && x <= col) {
+		for(end = i + MARK_STEP; i < end && i < l->len; i += len) {
+			if((len = line_run(l, i, end - i))) {
+				x += len;
+				continue;
+			}
+			p = line_cluster(l, i, &len);
+			x += ui->text_width(p, len, x);
+		}
+		if(lo->n + 1 == lo->cap) {
+			a = arena_alloc(&b->arena, 4 * sizeof(int) * lo->cap);
+			memcpy(a, lo->idx, sizeof(int) * lo->cap);
+			memcpy(a + 2 * lo->cap, lo->col, sizeof(int) * lo->cap);
+			arena_free(&b->arena, lo->idx, 2 * sizeof(int) * lo->cap);
+			lo->cap *= 2;
+			lo->idx = a;
+			lo->col = a + lo->cap;
+		}
+		++lo->n;
+		lo->idx[lo->n] = i;
+		lo->col[lo->n] = x;
+	}
+	return lo;
+}
+
+/* layout of l with the rows at the view width first */
+Layout *
+line_wrap(View *v, Line *l) {
+	Buffer *b = v->buf;
+	Layout *lo;
+	Wrap **p, *w;
+	int k, n = 0, cols = v->screen_cols;
+
+	if(!(lo = line_marks(b, l, INT_MAX, INT_MAX)) || lo->sparse)
+		return lo;
+	for(p = &lo->wrap, k = 0; (w = *p); p = &w->next, k++) {
+		if(w->cols == cols) {
+			*p = w->next;
+			w->next = lo->wrap;
+			lo->wrap = w;
+			return lo;
+		}
+		if(k == WRAP_WIDTHS - 1) {
+			*p = NULL;
+			wrap_free(&b->arena, w);
+			break;
+		}
+	}
+
+	/* a cluster goes to the next row if it does not fit */
+	layout_reserve(lo->n + 1);
+	layout_idx[n++] = 0;
+	for(k = 1; k < lo->n; k++)
+		if(lo->col[k + 1] - lo->col[layout_idx[n - 1]] > cols)
+			layout_idx[n++] = k;
+	layout_idx[n] = lo->n;
+
+	w = arena_alloc(&b->arena, sizeof(Wrap) + sizeof(int) * (n + 1));
+	memcpy(w->rowk, layout_idx, sizeof(int) * (n + 1));
+	w->nrows = n;
+	w->cols = cols;
+	w->next = lo->wrap;
+	lo->wrap = w;
+	return lo;
+}
+
+/* screen rows taken by l */
+int
+line_rows(View *v, Line *l) {
+	Layout *lo;
+	int w;
+
+	if(!v->wrap)
+		return 1;
+	lo = line_wrap(v, l);
+	if(!lo->sparse)
+		return lo->wrap->nrows;
+	w = lo->col[lo->n];
+	return w ? (w + v->screen_cols - 1) / v->screen_cols : 1;
+}
+
+/* first column of row r of l, *w is its width */
+int
+line_row(View *v, Line *l, int r, int *w) {
+	Layout *lo = line_wrap(v, l);
+	int x;
+
+	if(lo->sparse) {
+		*w = v->screen_cols;
+		return r * v->screen_cols;
+	}
+	x = lo->col[lo->wrap->rowk[r]];
+	*w = lo->col[lo->wrap->rowk[r + 1]] - x;
+	if(*w > v->screen_cols)
+		*w = v->screen_cols;
+	return x;
+}
+
+/* row of l showing column x */
+int
+line_row_at(View *v, Line *l, int x) {
+	Layout *lo;
+	int lo_ = 0, hi, mid;
+
+	if(!v->wrap)
+		return 0;
+	lo = line_wrap(v, l);
+	hi = line_rows(v, l) - 1;
+	if(lo->sparse)
+		return x / v->screen_cols < hi ? x / v->screen_cols : hi;
+	while(lo_ < hi) {
+		mid = (lo_ + hi + 1) / 2;
+		if(lo->col[lo->wrap->rowk[mid]] <= x) lo_ = mid;
+		else hi = mid - 1;
+	}
+	return lo_;
+}
+
+/* last checkpoint at or before index */
+int
+marks_find(Layout *lo, int index) {
+	int k = layout_find(lo, index);
+
+	if(lo->idx[k] > index)
+		--k;
+	return k;
+}
+
+void
+layout_reserve(int n) {
+	if(n <= layout_cap)
+		return;
+	while(layout_cap < n)
+		layout_cap = layout_cap ? layout_cap * 2 : 1024;
+	layout_idx = erealloc(layout_idx, sizeof(int) * layout_cap);
+	layout_col = erealloc(layout_col, sizeof(int) * layout_cap);
+}
+
+void
+line_drop_layout(Arena *a, Line *l) {
+	Layout *lo = l->layout;
+
+	if(!lo)
+		return;
+	*lo->owner = NULL;
+	if(lo->sparse)
+		arena_free(a, lo->idx, 2 * sizeof(int) * lo->cap);
+	wrap_free(a, lo->wrap);
+	arena_free(a, lo, lo->size);
+	l->layout = NULL;
+}
+
+/* free the list of wrapped rows from w */
+void
+wrap_free(Arena *a, Wrap *w) {
+	Wrap *next;
+
+	for(; w; w = next) {
+		next = w->next;
+		arena_free(a, w, sizeof(Wrap) + sizeof(int) * (w->nrows + 1));
+	}
+}
+
+/* forget what an edit at index invalidates, checkpoints before it stay */
+void
+layout_cut(Arena *a, Line *l, int index) {
+	Layout *lo = l->layout;
+
+	if(!lo || !lo->sparse) {
+		line_drop_layout(a, l);
+		return;
+	}
+	while(lo->n && lo->idx[lo->n] >= index)
+		--lo->n;
+}
+
+/* first cluster starting at or after byte index */
+int
+layout_find(Layout *lo, int index) {
+	int lo_ = 0, hi = lo->n, mid;
+
+	while(lo_ < hi) {
+		mid = (lo_ + hi) / 2;
+		if(lo->idx[mid] < index) lo_ = mid + 1;
+		else hi = mid;
+	}
+	return lo_;
+}
+
+/* cluster covering display column col */
+int
+layout_find_col(Layout *lo, int col) {
+	int lo_ = 0, hi = lo->n, mid;
+
+	while(lo_ < hi) {
+		mid = (lo_ + hi) / 2;
+		if(lo->col[mid + 1] <= col) lo_ = mid + 1;
+		else hi = mid;
+	}
+	return lo_;
+}
+
+Line *
+line_create(Arena *a, char *txt, int len) {
+	Line *l = arena_alloc(a, sizeof(Line));
+
+	memset(l, 0, sizeof(Line));
+	if(len) {
+		l->len = len;
+		l->cap = arena_size(l->len + 1);
+		l->buf = arena_alloc(a, l->cap);
+		memcpy(l->buf, txt, l->len);
+		l->gap = l->len;
+		l->gaplen = l->cap - l->len;
+	}
+	return l;
+}
+
+Line *
+line_create_ref(Arena *a, char *p, int len) {
+	Line *l = arena_alloc(a, sizeof(Line));
+
+	memset(l, 0, sizeof(Line));
+	l->buf = p;
+	l->len = len;
+	l->gap = len;
+	return l;
+}
+
+void
+line_destroy(Arena *a, Line *l) {
+	line_drop_layout(a, l);
+	if(l->cap)
+		arena_free(a, l->buf, l->cap);
+	arena_free(a, l, sizeof(Line));
+}
+
+Chunk *
+chunk_create(void) {
+	Chunk *c = ecalloc(1, sizeof(Chunk));
+
+	chunk_seed ^= chunk_seed << 13;
+	chunk_seed ^= chunk_seed >> 17;
+	chunk_seed ^= chunk_seed << 5;
+	c->prio = chunk_seed;
+	return c;
+}
+
+/* lines are left alone when a is NULL, they go with the arena */
+void
+chunk_free(Chunk *c, Arena *a) {
+	int i;
+
+	if(!c) return;
+	chunk_free(c->left, a);
+	chunk_free(c->right, a);
+	for(i = 0; a && i < c->len; i++)
+		line_destroy(a, c->lines[i]);
+	free(c);
+}
+
+size_t
+chunk_count(Chunk *c) {
+	return c ? c->count : 0;
+}
+
+void
+chunk_update(Chunk *c) {
+	c->count = chunk_count(c->left) + c->len + chunk_count(c->right);
+}
+
+Chunk *
+chunk_merge(Chunk *a, Chunk *b) {
+	if(!a) return b;
+	if(!b) return a;
+	if(a->prio > b->prio) {
+		a->right = chunk_merge(a->right, b);
+		chunk_update(a);
+		return a;
+	}
+	b->left = chunk_merge(a, b->left);
+	chunk_update(b);
+	return b;
+}
+
+/* split so that l holds the first idx lines and r the rest */
+void
+chunk_split(Chunk *c, size_t idx, Chunk **l, Chunk **r) {
+	Chunk *n;
+	size_t lc;
+
+	if(!c) {
+		*l = *r = NULL;
+		return;
+	}
+	lc = chunk_count(c->left);
+	if(idx <= lc) {
+		chunk_split(c->left, idx, l, &c->left);
+		*r = c;
+	} else if(idx >= lc + c->len) {
+		chunk_split(c->right, idx - lc - c->len, &c->right, r);
+		*l = c;
+	} else {
+		/* cut through this chunk, the tail becomes a new node */
+		idx -= lc;
+		n = chunk_create();
+		n->len = c->len - idx;
+		memcpy(n->lines, c->lines + idx, n->len * sizeof(Line *));
+		memcpy(n->hl, c->hl + idx, n->len);
+		chunk_update(n);
+		c->len = idx;
+		c->block = 0;
+		*r = chunk_merge(n, c->right);
+		c->right = NULL;
+		*l = c;
+	}
+	chunk_update(c);
+}
+
+/* return the chunk holding line *idx and make *idx relative to it */
+Chunk *
+chunk_find(Chunk *c, size_t *idx) {
+	size_t lc;
+
+	while(c) {
+		lc = chunk_count(c->left);
+		if(*idx < lc) {
+			c = c->left;
+			continue;
+		}
+		*idx -= lc;
+		if(*idx < c->len)
+			return c;
+		*idx -= c->len;
+		c = c->right;
+	}
+	return NULL;
+}
+
+/* insert into the chunk holding line idx - 1, returns 0 when it is full */
+int
+chunk_insert(Chunk *c, size_t idx, Line *line) {
+	size_t lc = chunk_count(c->left);
+	int r;
+
+	if(idx < lc || (idx == lc && lc)) {
+		r = chunk_insert(c->left, idx, line);
+	} else if(idx - lc > c->len) {
+		r = chunk_insert(c->right, idx - lc - c->len, line);
+	} else {
+		if(c->len == CHUNK_LINES)
+			return 0;
+		idx -= lc;
+		memmove(c->lines + idx + 1, c->lines + idx, (c->len - idx) * sizeof(Line *));
+		memmove(c->hl + idx + 1, c->hl + idx, c->len - idx);
+		c->lines[idx] = line;
+		c->hl[idx] = HL_UNKNOWN;
+		++c->len;
+		c->block = 0;
+		r = 1;
+	}
+	if(r)
+		++c->count;
+	return r;
+}
+
+Chunk *
+chunk_drop_first(Chunk *c, int len) {
+	Chunk *r;
+
+	if(!c->left) {
+		r = c->right;
+		free(c);
+		return r;
+	}
+	c->left = chunk_drop_first(c->left, len);
+	c->count -= len;
+	return c;
+}
+
+/* a treap of chunks holding lines, in order */
+Chunk *
+chunk_build(Line **lines, size_t n) {
+	Chunk *c, *m = NULL;
+	size_t i;
+
+	for(i = 0; i < n; i += c->len) {
+		c = chunk_create();
+		c->len = n - i < CHUNK_LINES ? n - i : CHUNK_LINES;
+		memcpy(c->lines, lines + i, c->len * sizeof(Line *));
+		memset(c->hl, HL_UNKNOWN, c->len);
+		chunk_update(c);
+		m = chunk_merge(m, c);
+	}
+	return m;
+}
+
+/* memory taken by the chunks and their lines */
+size_t
+chunk_bytes(Chunk *c) {
+	size_t n;
+	int i;
+
+	if(!c)
+		return 0;
+	n = sizeof(Chunk) + chunk_bytes(c->left) + chunk_bytes(c->right);
+	for(i = 0; i < c->len; i++)
+		n += sizeof(Line) + c->lines[i]->cap;
+	return n;
+}
+
+/* put the lines of m before line index */
+void
+buffer_splice(Buffer *b, int index, Chunk *m) {
+	Chunk *l, *r;
+	size_t n = chunk_count(m);
+
+	assert(index >= 0 && index <= b->lines_tot);
+	buffer_edit(b, -1);
+	chunk_split(b->root, index, &l, &r);
+	b->root = chunk_merge(chunk_merge(l, m), r);
+	b->lines_tot += n;
+	if(b->loading_thread && index <= b->load_next)
+		b->load_next += n;
+	buffer_coalesce(b, index);
+	buffer_coalesce(b, index + n);
+	buffer_move(b, index, n);
+}
+
+/* take count lines out of the buffer, at least one line is left */
+Chunk *
+buffer_cut(Buffer *b, int index, int count) {
+	Chunk *c, *m, *r;
+
+	buffer_edit(b, -1);
+	chunk_split(b->root, index, &c, &r);
+	chunk_split(r, count, &m, &r);
+	index_clear(m); /* the index may be built over before they return */
+	b->root = chunk_merge(c, r);
+	b->lines_tot -= count;
+	if(b->loading_thread && index < b->load_next)
+		b->load_next -= index + count < b->load_next ? count : b->load_next - index;
+	buffer_coalesce(b, index);
+	buffer_move(b, index, -count);
+	return m;
+}
+
+void
+buffer_insert_line(Buffer *b, int index, Line *line) {
+	Chunk *l, *r;
+	size_t at = index ? index - 1 : 0, i = at;
+
+	assert(index >= 0 && index <= b->lines_tot);
+	buffer_edit(b, -1);
+	undo_lines(b, UNDO_LINES_IN, index, 1, NULL);
+	if(!b->root)
+		b->root = chunk_create();
+	if(!chunk_insert(b->root, index, line)) {
+		/* split the full chunk in half and retry */
+		chunk_find(b->root, &i);
+		chunk_split(b->root, at - i + CHUNK_LINES / 2, &l, &r);
+		b->root = chunk_merge(l, r);
+		chunk_insert(b->root, index, line);
+	}
+	++b->lines_tot;
+	if(b->loading_thread && index <= b->load_next)
+		++b->load_next;
+	buffer_move(b, index, 1);
+}
+
+void
+buffer_insert_lines(Buffer *b, int index, Line **lines, size_t n) {
+	undo_lines(b, UNDO_LINES_IN, index, n, NULL);
+	buffer_splice(b, index, chunk_build(lines, n));
+}
+
+void
+buffer_delete_line(Buffer *b, int index, int count) {
+	Chunk *m;
+	Line *l;
+
+	if(index < 0 || index >= b->lines_tot) return;
+	if(index + count > b->lines_tot) count = b->lines_tot - index;
+
+	/* do not remove the only existing line (but clear it) */
+	if(b->lines_tot == 1 && !index) {
+		l = buffer_get_line(b, 0);
+		buffer_edit(b, 0);
+		undo_delete(b, 0, 0, l->len);
+		line_drop_layout(&b->arena, l);
+		l->len = l->gap = 0;
+		l->gaplen = l->cap;
+		buffer_damage(b, 0, 0);
+		return;
+	}
+
+	m = buffer_cut(b, index, count);
+	if(b->undo.max)
+		undo_lines(b, UNDO_LINES_OUT, index, count, m);
+	else
+		chunk_free(m, &b->arena);
+}
+
+/* join the chunks meeting at line index when they fit into one */
+void
+buffer_coalesce(Buffer *b, size_t index) {
+	Chunk *l, *r, *a, *c;
+
+	if(!index || index >= b->lines_tot)
+		return;
+	chunk_split(b->root, index, &l, &r);
+	for(a = l; a->right; a = a->right);
+	for(c = r; c->left; c = c->left);
+	if(a->len + c->len <= CHUNK_LINES) {
+		memcpy(a->lines + a->len, c->lines, c->len * sizeof(Line *));
+		memcpy(a->hl + a->len, c->hl, c->len);
+		a->len += c->len;
+		a->block = 0;
+		for(a = l; a; a = a->right)
+			a->count += c->len;
+		r = chunk_drop_first(r, c->len);
+	}
+	b->root = chunk_merge(l, r);
+}
+
+void
+buffer_insert_text(Buffer *b, int index, int col, char *txt, int len) {
+	buffer_edit(b, index);
+	undo_insert(b, index, col, txt, len);
+	line_insert_text(&b->arena, buffer_get_line(b, index), col, txt, len);
+	buffer_damage(b, index, index);
+}
+
+void
+buffer_delete_text(Buffer *b, int index, int col, int count) {
+	buffer_edit(b, index);
+	undo_delete(b, index, col, count);
+	line_delete_char(&b->arena, buffer_get_line(b, index), col, count);
+	buffer_damage(b, index, index);
+}
+
+/* insert text spanning any number of lines at index, col and move them
+ * past it. New lines are spliced into the buffer all at once. */
+void
+buffer_insert_data(Buffer *b, int *index, int *col, char *txt, size_t len) {
+	Line *l = buffer_get_line(b, *index), *last;
+	Line **lines = NULL;
+	size_t n = 0, cap = 0;
+	char *p, *end = txt + len, *first, *nl, *tail;
+	int taillen, i, m;
+
+	/* pasted text is never part of what was typed around it */
+	b->undo.typing = 0;
+	if(!(first = memchr(txt, '\n', len))) {
+		buffer_insert_text(b, *index, *col, txt, len);
+		b->undo.typing = 0;
+		*col += len;
+		return;
+	}
+
+	/* everything after the first newline becomes new lines */
+	for(p = first + 1; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		if(n == cap) {
+			cap = cap ? cap * 2 : 64;
+			lines = erealloc(lines, sizeof(Line *) * cap);
+		}
+		lines[n++] = line_create(&b->arena, p, nl - p);
+	}
+	if(n == cap)
+		lines = erealloc(lines, sizeof(Line *) * (cap + 1));
+	last = lines[n++] = line_create(&b->arena, p, end - p);
+
+	/* the rest of the current line moves to the last one, copied around
+	 * the gap once nothing else reads the line */
+	buffer_edit(b, *index);
+	taillen = l->len - *col;
+	for(i = 0; i < taillen; i += m) {
+		tail = line_span(l, *col + i, &m);
+		line_insert_text(&b->arena, last, last->len, tail, m);
+	}
+	if(taillen)
+		buffer_delete_text(b, *index, *col, taillen);
+	if(first > txt)
+		buffer_insert_text(b, *index, *col, txt, first - txt);
+
+	buffer_insert_lines(b, *index + 1, lines, n);
+	free(lines);
+	*index += n;
+	*col = last->len - taillen;
+}
+
+/* lines from..to (inclusive) need to be redrawn in every view */
+void
+buffer_damage(Buffer *b, int from, int to) {
+	View *v;
+
+	for(v = b->views; v; v = v->next) {
+		if(from < v->dmg_from) v->dmg_from = from;
+		if(to > v->dmg_to) v->dmg_to = to;
+	}
+}
+
+/* n lines were inserted at index, or -n removed. The other views keep
+ * showing the same text: those below follow it and are left alone, the
+ * rest get the lines from index redrawn. The cursor of vcur is up to the
+ * caller. The first line moved in and the one after the change follow
+ * other lines now, their lexer states are checked again. */
+void
+buffer_move(Buffer *b, int index, int n) {
+	int end = n > 0 ? index : index - n;
+	unsigned char *hl;
+	View *v;
+
+	if((hl = hl_state(b, index)))
+		*hl |= HL_DIRTY;
+	if(n > 0 && (hl = hl_state(b, index + n)))
+		*hl |= HL_DIRTY;
+	search_move(b, index, n);
+
+	for(v = b->views; v; v = v->next) {
+		/* damage already there moves along with its lines */
+		if(v->dmg_from <= v->dmg_to) {
+			if(v->dmg_from >= end) v->dmg_from += n;
+			else if(v->dmg_from >= index) v->dmg_from = index;
+			if(v->dmg_to >= end) {
+				if(v->dmg_to != INT_MAX) v->dmg_to += n;
+			} else if(v->dmg_to >= index) {
+				v->dmg_to = index;
+			}
+		}
+		if(v == vcur) {
+			if(index < v->dmg_from) v->dmg_from = index;
+			v->dmg_to = INT_MAX;
+			continue;
+		}
+		if(v->row_off >= end && v->drawn_row_off >= end) {
+			v->row_off += n;
+			v->drawn_row_off += n;
+		} else {
+			if(v->row_off >= end) {
+				v->row_off += n;
+			} else if(v->row_off >= index) {
+				v->row_off = index;
+				v->row_sub = 0;
+			}
+			if(index < v->dmg_from) v->dmg_from = index;
+			v->dmg_to = INT_MAX;
+		}
+		if(v->line_idx >= end)
+			v->line_idx += n;
+		else if(v->line_idx >= index)
+			v->line_idx = index;
+	}
+}
+
+/* Stop the threads reading the lines before they change. The text of line
+ * index changes too unless it is -1, its chunk has to be indexed again, the
+ * line lexed and searched. */
+void
+buffer_edit(Buffer *b, int index) {
+	Search *s = &b->search;
+	size_t i = index;
+	Chunk *c;
+
+	if(!s->done || s->n != s->count)
+		search_stop(b);
+	else if(index >= 0)
+		search_touch(b, index, index);
+	index_stop(b);
+	b->index.done = 0;
+	if(index >= 0 && (c = chunk_find(b->root, &i))) {
+		c->block = 0;
+		c->hl[i] |= HL_DIRTY;
+	}
+}
+
+/* log a change after dropping the undone ones */
+Change *
+undo_add(Buffer *b, int type, int line, int col, int len) {
+	Undo *u = &b->undo;
+	Change *c;
+	int cap = type <= UNDO_DELETE ? len : 0;
+
+	while(u->tail != u->cur) {
+		c = u->tail;
+		if(!(u->tail = c->prev))
+			u->head = NULL;
+		undo_free(b, c);
+	}
+	if(u->tail)
+		u->tail->next = NULL;
+
+	c = arena_alloc(&u->arena, sizeof(Change) + cap);
+	memset(c, 0, sizeof(Change));
+	c->type = type;
+	c->line = line;
+	c->col = col;
+	c->len = len;
+	c->cap = cap;
+	c->cont = !u->group && u->tail;
+	c->prev = u->tail;
+	if(u->tail)
+		u->tail->next = c;
+	else
+		u->head = c;
+	u->tail = u->cur = c;
+	u->size += arena_size(sizeof(Change) + cap);
+	u->group = u->typing = 0;
+	return c;
+}
+
+void
+undo_insert(Buffer *b, int line, int col, char *txt, int len) {
+	Undo *u = &b->undo;
+	Change *c = u->tail;
+	int cap;
+
+	if(!u->max || !len)
+		return;
+	/* typing one character after the other grows the same change */
+	if(len == 1 && u->typing && u->cur == c && c->line == line
+	&& c->col + c->len == col) {
+		if(c->len == c->cap) {
+			cap = c->cap * 2;
+			u->size -= arena_size(sizeof(Change) + c->cap);
+			c = arena_realloc(&u->arena, c, sizeof(Change) + c->cap, sizeof(Change) + cap);
+			u->size += arena_size(sizeof(Change) + cap);
+			c->cap = cap;
+			if(c->prev)
+				c->prev->next = c;
+			else
+				u->head = c;
+			u->tail = u->cur = c;
+		}
+		c->text[c->len++] = *txt;
+	} else {
+		c = undo_add(b, UNDO_INSERT, line, col, len);
+		memcpy(c->text, txt, len);
+		u->typing = len == 1;
+	}
+	undo_trim(b);
+}
+
+void
+undo_delete(Buffer *b, int line, int col, int len) {
+	Line *l;
+	Change *c;
+	char *s;
+	int i, n;
+
+	if(!b->undo.max || !len)
+		return;
+	l = buffer_get_line(b, line);
+	c = undo_add(b, UNDO_DELETE, line, col, len);
+	for(i = 0; i < len; i += n) {
+		s = line_span(l, col + i, &n);
+		if(n > len - i)
+			n = len - i;
+		memcpy(c->text + i, s, n);
+	}
+	undo_trim(b);
+}
+
+/* n lines in or out at index, m holds the removed ones */
+void
+undo_lines(Buffer *b, int type, int index, int n, Chunk *m) {
+	Change *c;
+
+	if(!b->undo.max || !n)
+		return;
+	c = undo_add(b, type, index, 0, n);
+	c->lines = m;
+	c->held = chunk_bytes(m);
+	b->undo.size += c->held;
+	undo_trim(b);
+}
+
+void
+undo_free(Buffer *b, Change *c) {
+	Undo *u = &b->undo;
+
+	chunk_free(c->lines, &b->arena);
+	u->size -= c->held + arena_size(sizeof(Change) + c->cap);
+	arena_free(&u->arena, c, sizeof(Change) + c->cap);
+}
+
+/* forget the oldest groups of changes while over the limit */
+void
+undo_trim(Buffer *b) {
+	Undo *u = &b->undo;
+	Change *c;
+
+	while(u->head && (u->size > u->max || u->head->cont)) {
+		c = u->head;
+		if((u->head = c->next))
+			u->head->prev = NULL;
+		else
+			u->tail = NULL;
+		if(u->cur == c)
+			u->cur = NULL;
+		undo_free(b, c);
+	}
+}
+
+/* changes from now on are undone separately from the previous ones */
+void
+undo_seal(Buffer *b) {
+	b->undo.group = 1;
+}
+
+/* do c again or its inverse, the types come in inverse pairs */
+void
+undo_apply(Buffer *b, Change *c, int redo) {
+	Undo *u = &b->undo;
+
+	buffer_edit(b, c->type == UNDO_INSERT || c->type == UNDO_DELETE ? c->line : -1);
+	switch(redo ? c->type : c->type ^ 1) {
+	case UNDO_INSERT:
+		line_insert_text(&b->arena, buffer_get_line(b, c->line), c->col, c->text, c->len);
+		buffer_damage(b, c->line, c->line);
+		break;
+	case UNDO_DELETE:
+		line_delete_char(&b->arena, buffer_get_line(b, c->line), c->col, c->len);
+		buffer_damage(b, c->line, c->line);
+		break;
+	case UNDO_LINES_IN:
+		buffer_splice(b, c->line, c->lines);
+		u->size -= c->held;
+		c->lines = NULL;
+		c->held = 0;
+		break;
+	case UNDO_LINES_OUT:
+		c->lines = buffer_cut(b, c->line, c->len);
+		c->held = chunk_bytes(c->lines);
+		u->size += c->held;
+		break;
+	}
+}
+
+/* undo the last group of changes, *line and *col are set to its start */
+int
+buffer_undo(Buffer *b, int *line, int *col) {
+	Undo *u = &b->undo;
+	Change *c;
+
+	if(!u->cur)
+		return 0;
+	do {
+		c = u->cur;
+		undo_apply(b, c, 0);
+		u->cur = c->prev;
+	} while(c->cont);
+	*line = c->line;
+	*col = c->type <= UNDO_DELETE ? c->col : 0;
+	u->group = 1;
+	u->typing = 0;
+	return 1;
+}
+
+/* redo the next group of changes, *line and *col are set to its end */
+int
+buffer_redo(Buffer *b, int *line, int *col) {
+	Undo *u = &b->undo;
+	Change *c = u->cur ? u->cur->next : u->head;
+
+	if(!c)
+		return 0;
+	do {
+		undo_apply(b, c, 1);
+		u->cur = c;
+	} while((c = c->next) && c->cont);
+	c = u->cur;
+	*line = c->line;
+	*col = c->type == UNDO_INSERT ? c->col + c->len : c->col;
+	u->group = 1;
+	u->typing = 0;
+	return 1;
+}
+
+void
+undo_release(Buffer *b) {
+	Change *c;
+
+	/* the lines held go away with the buffer arena */
+	for(c = b->undo.head; c; c = c->next)
+		chunk_free(c->lines, NULL);
+	arena_release(&b->undo.arena);
+	memset(&b->undo, 0, sizeof(Undo));
+}
+
+/* lexer state of line index, NULL past the end */
+unsigned char *
+hl_state(Buffer *b, int index) {
+	size_t i = index;
+	Chunk *c;
+
+	if(index < 0 || index >= b->lines_tot)
+		return NULL;
+	c = chunk_find(b->root, &i);
+	return c->hl + i;
+}
+
+/* the state line index starts in, as far as it is known */
+int
+hl_start(Buffer *b, int index) {
+	unsigned char *hl = hl_state(b, index - 1);
+
+	return !hl || *hl == HL_UNKNOWN ? HL_NORMAL : *hl & ~HL_DIRTY;
+}
+
+/* attribute of an identifier, ATTR_NONE if it is not a keyword */
+int
+hl_word(char *s, int len) {
+	Keyword *k;
+	int i, h;
+
+	if(!keywords_hashed) {
+		for(i = 0; i < LENGTH(keywords); i++) {
+			h = KEYWORD_HASH(keywords[i].word, strlen(keywords[i].word));
+			while(keyword_slots[h])
+				h = (h + 1) % KEYWORD_SLOTS;
+			keyword_slots[h] = &keywords[i];
+		}
+		keywords_hashed = 1;
+	}
+	if(len < 2 || len > 8)
+		return ATTR_NONE;
+	for(h = KEYWORD_HASH(s, len); (k = keyword_slots[h]); h = (h + 1) % KEYWORD_SLOTS)
+		if(k->word[0] == s[0] && !strncmp(k->word, s, len) && !k->word[len])
+			return k->attr;
+	return ATTR_NONE;
+}
+
+/* bytes start to end get attr, kept if they show between from and to */
+void
+hl_span(int start, int end, int attr, int from, int to) {
+	if(end <= from || start >= to)
+		return;
+	if(nattrs == attrs_cap) {
+		attrs_cap = attrs_cap ? attrs_cap * 2 : 64;
+		attrs = erealloc(attrs, sizeof(Span) * attrs_cap);
+	}
+	attrs[nattrs].start = start;
+	attrs[nattrs].end = end;
+	attrs[nattrs].flags = 0;
+	attrs[nattrs++].attr = attr;
+}
+
+/* Past the end of the comment (quote '*') or literal going on at i, -1 if
+ * the line ends first and -2 if it ends escaped. */
+int
+hl_end(char *s, int len, int i, int quote) {
+	for(; i < len; i++) {
+		if(quote == '*') {
+			if(s[i] == '*' && i + 1 < len && s[i + 1] == '/')
+				return i + 2;
+		} else if(s[i] == '\\') {
+			if(++i == len)
+				return -2;
+		} else if(s[i] == quote) {
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+/* Lexes a line of C starting in state and returns the state at its end.
+ * Tokens between bytes from and to go into attrs. */
+int
+hl_lex(char *s, int len, int state, int from, int to) {
+	int i = 0, j, pre = state == HL_PREPROC, bol = !pre, attr;
+	unsigned char c;
+
+	if(state == HL_COMMENT || state == HL_STRING) {
+		i = hl_end(s, len, 0, state == HL_COMMENT ? '*' : '"');
+		hl_span(0, i < 0 ? len : i, state == HL_COMMENT ? ATTR_COMMENT : ATTR_STRING,
+			from, to);
+		if(i == -1)
+			return state == HL_COMMENT ? HL_COMMENT : HL_NORMAL;
+		if(i == -2)
+			return state;
+		bol = 0;
+	}
+	for(; i < len; i = j) {
+		/* past to only comments and literals change the state */
+		if(i >= to && !bol)
+			for(; i < len && !hl_stops[(unsigned char)s[i]]; i++);
+		if(i == len)
+			break;
+		c = s[i];
+		j = i + 1;
+		if(c == '/' && j < len && s[j] == '/') {
+			hl_span(i, len, ATTR_COMMENT, from, to);
+			return HL_NORMAL;
+		} else if(c == '/' && j < len && s[j] == '*') {
+			j = hl_end(s, len, j + 1, '*');
+			hl_span(i, j < 0 ? len : j, ATTR_COMMENT, from, to);
+			if(j < 0)
+				return HL_COMMENT;
+		} else if(c == '"' || c == '\'') {
+			j = hl_end(s, len, j, c);
+			hl_span(i, j < 0 ? len : j, ATTR_STRING, from, to);
+			if(j == -2 && c == '"')
+				return HL_STRING;
+			if(j < 0)
+				break;
+		} else if(c == '#' && bol) {
+			for(; j < len && (s[j] == ' ' || s[j] == '\t'); j++);
+			for(; j < len && HL_ALPHA(s[j]); j++);
+			hl_span(i, j, ATTR_PREPROC, from, to);
+			pre = 1;
+		} else if(HL_DIGIT(c) || (c == '.' && j < len && HL_DIGIT(s[j]))) {
+			for(; j < len && (HL_ALPHA(s[j]) || HL_DIGIT(s[j]) || s[j] == '.'); j++);
+			hl_span(i, j, ATTR_NUMBER, from, to);
+		} else if(HL_ALPHA(c)) {
+			for(; j < len && (HL_ALPHA(s[j]) || HL_DIGIT(s[j])); j++);
+			if(j > from && i < to && (attr = hl_word(s + i, j - i)))
+				hl_span(i, j, attr, from, to);
+		}
+		if(c != ' ' && c != '\t')
+			bol = 0;
+	}
+	return pre && len && s[len - 1] == '\\' ? HL_PREPROC : HL_NORMAL;
+}
+
+/* Lexes l, see hl_lex(). The text is read around the gap as the finders
+ * may be reading it too. Long lines are left as they are. */
+int
+hl_line(Line *l, int state, int from, int to) {
+	char *p = l->buf;
+
+	if(l->len > HL_LINE_MAX)
+		return state;
+	if(l->gap < l->len) {
+		if(l->len > hl_text_cap) {
+			hl_text_cap = l->len * 2;
+			hl_text = erealloc(hl_text, hl_text_cap);
+		}
+		memcpy(hl_text, l->buf, l->gap);
+		memcpy(hl_text + l->gap, l->buf + l->gap + l->gaplen, l->len - l->gap);
+		p = hl_text;
+	}
+	return hl_lex(p, l->len, state, from, to);
+}
+
+/* Brings the lexer states of lines from..to up to date. Lexing starts at
+ * the first dirty line up to HL_SYNC lines above, or right above from if
+ * none, and a line is lexed again only if it is dirty or the state before
+ * it changed. Once a state comes out as it was the ones below hold again.
+ * The lines whose start state changed are damaged in every view, and if
+ * the states have not settled by line to the next one is left dirty. */
+void
+hl_update(Buffer *b, int from, int to) {
+	Chunk *c = NULL;
+	size_t i = 0;
+	int k, state, old, changed = 0;
+	unsigned char *hl;
+
+	if(to >= b->lines_tot)
+		to = b->lines_tot - 1;
+	for(k = from > HL_SYNC ? from - HL_SYNC : 0; k < from; k++, i++) {
+		if(!c || i == c->len) {
+			i = k;
+			c = chunk_find(b->root, &i);
+		}
+		if(c->hl[i] & HL_DIRTY)
+			break;
+	}
+	state = hl_start(b, k);
+	for(c = NULL; k <= to; k++, i++) {
+		if(!c || i == c->len) {
+			i = k;
+			c = chunk_find(b->root, &i);
+		}
+		if(!(c->hl[i] & HL_DIRTY) && !changed) {
+			state = c->hl[i];
+			continue;
+		}
+		old = c->hl[i] & ~HL_DIRTY;
+		state = c->hl[i] = hl_line(c->lines[i], state, 0, 0);
+		if((changed = state != old))
+			buffer_damage(b, k + 1, k + 1);
+	}
+	if(changed && (hl = hl_state(b, to + 1)))
+		*hl |= HL_DIRTY;
+}
+
+/* Spans of the tokens of l showing between columns x and x + w, lexed
+ * from state. */
+void
+line_highlight(Buffer *b, Line *l, int state, int x, int w) {
+	Layout *lo = line_marks(b, l, INT_MAX, x + w);
+	int k = layout_find_col(lo, x + w);
+
+	nattrs = 0;
+	hl_line(l, state, lo->idx[layout_find_col(lo, x)],
+		k < lo->n ? lo->idx[k + 1] : l->len);
+}
+
+/* Offset of the first match of q in l between from and end, -1 if none.
+ * Both sides of the gap are read in place, so the finder threads can use
+ * it too. */
+int
+line_find(Line *l, int from, int end, char *q, int qlen) {
+	char tmp[2 * SEARCH_MAX];
+	int r, lo, hi;
+
+	if(from < l->gap) {
+		r = utf8_find(l->buf + from, (end < l->gap ? end : l->gap) - from, q, qlen);
+		if(r != -1)
+			return from + r;
+
+		/* matches across the gap */
+		lo = l->gap - qlen + 1 > from ? l->gap - qlen + 1 : from;
+		hi = l->gap + qlen - 1 < end ? l->gap + qlen - 1 : end;
+		if(hi > l->gap) {
+			memcpy(tmp, l->buf + lo, l->gap - lo);
+			memcpy(tmp + l->gap - lo, l->buf + l->gap + l->gaplen, hi - l->gap);
+			if((r = utf8_find(tmp, hi - lo, q, qlen)) != -1)
+				return lo + r;
+		}
+		from = l->gap;
+	}
+	if(from >= end)
+		return -1;
+	r = utf8_find(l->buf + l->gaplen + from, end - from, q, qlen);
+	return r == -1 ? -1 : from + r;
+}
+
+/* whether q is at col in l */
+int
+line_match(Line *l, int col, char *q, int qlen) {
+	char *s;
+	int i, n;
+
+	if(col + qlen > l->len)
+		return 0;
+	for(i = 0; i < qlen; i += n) {
+		s = line_span(l, col + i, &n);
+		if(n > qlen - i)
+			n = qlen - i;
+		if(memcmp(s, q + i, n))
+			return 0;
+	}
+	return 1;
+}
+
+/* Spans of the matches showing between columns x and x + w. Found right
+ * away in the line, whatever the finders have done so far. */
+void
+line_matches(Buffer *b, Line *l, int x, int w) {
+	Search *s = &b->search;
+	Layout *lo = line_marks(b, l, INT_MAX, x + w);
+	int from, to, k, at;
+
+	nspans = 0;
+	if(!s->len)
+		return;
+	from = lo->idx[layout_find_col(lo, x)] - s->len + 1;
+	k = layout_find_col(lo, x + w);
+	to = k < lo->n ? lo->idx[k + 1] + s->len - 1 : l->len;
+	if(from < 0)
+		from = 0;
+	if(to > l->len)
+		to = l->len;
+	for(; (at = line_find(l, from, to, s->query, s->len)) != -1; from = at + 1) {
+		if(nspans && spans[nspans - 1].end > at) {
+			spans[nspans - 1].end = at + s->len;
+			continue;
+		}
+		if(nspans == spans_cap) {
+			spans_cap = spans_cap ? spans_cap * 2 : 64;
+			spans = erealloc(spans, sizeof(Span) * spans_cap);
+		}
+		spans[nspans].start = at;
+		spans[nspans].end = at + s->len;
+		spans[nspans++].flags = CELL_MATCH;
+	}
+}
+
+void
+search_set(Buffer *b, char *q, int len) {
+	Search *s = &b->search;
+	Line *l = NULL;
+	size_t i, j;
+	int at = -1;
+
+	if(len > SEARCH_MAX)
+		len = SEARCH_MAX;
+	search_update(b);
+	if(s->done && s->n == s->count && s->len && len > s->len
+	&& !memcmp(q, s->query, s->len)) {
+		for(i = j = 0; i < s->n; i++) {
+			if(s->m[i].line != at)
+				l = buffer_get_line(b, at = s->m[i].line);
+			if(line_match(l, s->m[i].col, q, len))
+				s->m[j++] = s->m[i];
+		}
+		s->n = s->count = j;
+	} else {
+		search_stop(b);
+	}
+	memcpy(s->query, q, len);
+	s->len = len;
+}
+
+/* count the matches of the whole buffer, one range of lines per core,
+ * skipping the blocks the index rules out */
+void
+search_start(Buffer *b) {
+	Search *s = &b->search;
+	Finder *f;
+	long n;
+	int i;
+
+	index_stop(b);
+	s->blocks = index_lookup(b, s->query, s->len);
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > b->lines_tot / SEARCH_SPLIT + 1)
+		n = b->lines_tot / SEARCH_SPLIT + 1;
+	if(n > SEARCH_THREADS)
+		n = SEARCH_THREADS;
+	if(n < 1)
+		n = 1;
+	s->finders = ecalloc(n, sizeof(Finder));
+	s->nfinders = s->running = n;
+	for(i = 0; i < n; i++) {
+		f = &s->finders[i];
+		f->b = b;
+		f->from = b->lines_tot * i / n;
+		f->to = b->lines_tot * (i + 1) / n;
+		if(pthread_create(&f->tid, NULL, search_run, f))
+			die("Cannot start a search thread.");
+	}
+}
+
+void *
+search_run(void *arg) {
+	Finder *f = arg;
+	Buffer *b = f->b;
+	Search *s = &b->search;
+	Line **lines, *l;
+	Chunk *c;
+	size_t i = f->from, at, keep = SEARCH_KEEP / s->nfinders;
+	int k, col;
+
+	while(i < f->to && !__atomic_load_n(&s->cancel, __ATOMIC_RELAXED)) {
+		at = i;
+		c = chunk_find(b->root, &at);
+		lines = c->lines + at;
+		k = c->len - at;
+		if(s->blocks && c->block
+		&& !(s->blocks[c->block / LONG_BITS] >> c->block % LONG_BITS & 1)) {
+			i += k;
+			continue;
+		}
+		for(; k && i < f->to; k--, i++) {
+			l = *lines++;
+			col = 0;
+			while((col = line_find(l, col, l->len, s->query, s->len)) != -1) {
+				if(f->n == f->cap && f->n < keep) {
+					f->cap = f->cap ? f->cap * 2 : 1024;
+					f->m = erealloc(f->m, sizeof(Match) * f->cap);
+				}
+				if(f->n < f->cap) {
+					f->m[f->n].line = i;
+					f->m[f->n++].col = col;
+				}
+				++f->count;
+				++col;
+			}
+		}
+	}
+	pthread_mutex_lock(&b->lock);
+	if(!--s->running)
+		ui->wakeup();
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+/* cancel the finders and forget the matches */
+void
+search_stop(Buffer *b) {
+	Search *s = &b->search;
+	int i;
+
+	if(s->finders) {
+		__atomic_store_n(&s->cancel, 1, __ATOMIC_RELAXED);
+		for(i = 0; i < s->nfinders; i++) {
+			pthread_join(s->finders[i].tid, NULL);
+			free(s->finders[i].m);
+		}
+		free(s->finders);
+		s->finders = NULL;
+		s->cancel = 0;
+	}
+	free(s->blocks);
+	s->blocks = NULL;
+	s->n = s->count = 0;
+	s->done = 0;
+	s->stale_from = 0;
+	s->stale_to = -1;
+}
+
+/* start the finders when there is something to search, collect their
+ * matches once they are all done */
+void
+search_poll(Buffer *b) {
+	Search *s = &b->search;
+	Finder *f;
+	size_t n = 0;
+	int i, running;
+
+	search_update(b);
+	if(!s->len || s->done || b->loading_thread)
+		return;
+	if(!s->finders) {
+		search_start(b);
+		return;
+	}
+	pthread_mutex_lock(&b->lock);
+	running = s->running;
+	pthread_mutex_unlock(&b->lock);
+	if(running)
+		return;
+
+	for(i = 0; i < s->nfinders; i++)
+		n += s->finders[i].n;
+	if(n > s->cap) {
+		s->cap = n;
+		s->m = erealloc(s->m, sizeof(Match) * n);
+	}
+	for(i = 0; i < s->nfinders; i++) {
+		f = &s->finders[i];
+		pthread_join(f->tid, NULL);
+		if(f->n)
+			memcpy(s->m + s->n, f->m, sizeof(Match) * f->n);
+		s->n += f->n;
+		s->count += f->count;
+		free(f->m);
+	}
+	free(s->finders);
+	s->finders = NULL;
+	free(s->blocks);
+	s->blocks = NULL;
+	s->done = 1;
+	s->stale_from = 0;
+	s->stale_to = -1;
+}
+
+/* index of the first match on line or after it */
+size_t
+search_at(Search *s, int line) {
+	size_t lo = 0, hi = s->n, mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(s->m[mid].line < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* the text of lines from..to changes, search_update() looks at them again */
+void
+search_touch(Buffer *b, int from, int to) {
+	Search *s = &b->search;
+
+	if(s->stale_to < s->stale_from) {
+		s->stale_from = from;
+		s->stale_to = to;
+	} else {
+		if(from < s->stale_from) s->stale_from = from;
+		if(to > s->stale_to) s->stale_to = to;
+	}
+}
+
+/* n lines were inserted at index, or -n removed, the matches after them
+ * move along and the new lines are searched */
+void
+search_move(Buffer *b, int index, int n) {
+	Search *s = &b->search;
+	int end = n > 0 ? index : index - n;
+	size_t i, j;
+
+	if(!s->done || s->n != s->count)
+		return;
+	i = j = search_at(s, index);
+	if(n < 0)
+		i = search_at(s, end);
+	for(; i < s->n; i++, j++) {
+		s->m[j] = s->m[i];
+		s->m[j].line += n;
+	}
+	s->n = s->count = j;
+
+	if(s->stale_to >= s->stale_from) {
+		if(s->stale_from >= end) s->stale_from += n;
+		else if(s->stale_from >= index) s->stale_from = index;
+		if(s->stale_to >= end) s->stale_to += n;
+		else if(s->stale_to >= index) s->stale_to = index - 1;
+	}
+	if(n > 0)
+		search_touch(b, index, index + n - 1);
+}
+
+/* Search the lines changed since the matches were known again and put
+ * theirs in place of the old ones. Too many lines to do it here count
+ * the whole buffer over. */
+void
+search_update(Buffer *b) {
+	Search *s = &b->search;
+	Line *l;
+	size_t lo, hi, n = 0;
+	int i, col, to = s->stale_to;
+
+	if(to >= (int)b->lines_tot)
+		to = b->lines_tot - 1;
+	if(!s->done || s->n != s->count || to < s->stale_from)
+		return;
+	if(to - s->stale_from >= SEARCH_SPLIT) {
+		search_stop(b);
+		return;
+	}
+	for(i = s->stale_from; i <= to; i++) {
+		l = buffer_get_line(b, i);
+		for(col = 0; (col = line_find(l, col, l->len, s->query, s->len)) != -1; col++)
+			++n;
+	}
+	lo = search_at(s, s->stale_from);
+	hi = search_at(s, to + 1);
+	if(s->n - (hi - lo) + n > SEARCH_KEEP) {
+		search_stop(b);
+		return;
+	}
+	if(s->n - (hi - lo) + n > s->cap) {
+		s->cap = (s->n - (hi - lo) + n) * 2;
+		s->m = erealloc(s->m, sizeof(Match) * s->cap);
+	}
+	memmove(s->m + lo + n, s->m + hi, sizeof(Match) * (s->n - hi));
+	s->n = s->count = s->n - (hi - lo) + n;
+	for(i = s->stale_from; i <= to; i++) {
+		l = buffer_get_line(b, i);
+		for(col = 0; (col = line_find(l, col, l->len, s->query, s->len)) != -1; col++) {
+			s->m[lo].line = i;
+			s->m[lo++].col = col;
+		}
+	}
+	s->stale_from = 0;
+	s->stale_to = -1;
+}
+
+/* Move *line, *col to the next match after them, wrapping around. Looks
+ * it up in the matches when they are all known, else scans the lines. */
+int
+search_next(Buffer *b, int *line, int *col) {
+	Search *s = &b->search;
+	Line **lines, *l;
+	size_t lo = 0, hi, mid, n;
+	int i, k, at, from = *col + 1;
+
+	if(!s->len)
+		return 0;
+	search_update(b);
+	if(s->done && s->n == s->count) {
+		if(!s->n)
+			return 0;
+		for(hi = s->n; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if(s->m[mid].line < *line || (s->m[mid].line == *line && s->m[mid].col < from))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if(lo == s->n)
+			lo = 0;
+		*line = s->m[lo].line;
+		*col = s->m[lo].col;
+		return 1;
+	}
+
+	for(i = *line, n = 0; n <= b->lines_tot; ) {
+		if(i >= b->lines_tot)
+			i = 0;
+		for(k = buffer_get_lines(b, i, &lines); k && n <= b->lines_tot; k--, i++, n++) {
+			l = *lines++;
+			if((at = line_find(l, from, l->len, s->query, s->len)) != -1) {
+				*line = i;
+				*col = at;
+				return 1;
+			}
+			from = 0;
+		}
+	}
+	return 0;
+}
+
+/* a key typed into the query, the cursor goes to the first match from
+ * where the search started */
+void
+search_key(View *v, int key) {
+	Search *s = &v->buf->search;
+	char q[SEARCH_MAX];
+	int len = s->len, line = search_line, col = search_col - 1;
+
+	if(key == '\n') {
+		searching = 0;
+		return;
+	}
+	if((unsigned char)key < ' ' && key != '\t' && key != 0x1b && key != CTRL('h'))
+		return;
+	memcpy(q, s->query, len);
+	if(key == 0x1b) {
+		searching = 0;
+		len = 0;
+	} else if(key == 0x7f || key == CTRL('h')) {
+		while(len && (q[len - 1] & 0xc0) == 0x80)
+			--len;
+		if(len)
+			--len;
+	} else if(len < SEARCH_MAX) {
+		q[len++] = key;
+	}
+	search_set(v->buf, q, len);
+	v->line_idx = search_line;
+	v->col_idx = search_col;
+	if(search_next(v->buf, &line, &col)) {
+		v->line_idx = line;
+		v->col_idx = col;
+	}
+	buffer_damage(v->buf, 0, INT_MAX); /* the matches shown */
+}
+
+unsigned int
+trigram_hash(unsigned int t) {
+	return (t * 2654435761u) >> 14 & (INDEX_HASH - 1);
+}
+
+/* append block to a posting list as a varint delta from the last one */
+void
+posting_add(Index *x, Posting *p, unsigned int block) {
+	unsigned int d = block - p->last;
+
+	if(p->len + 5 > p->cap) {
+		x->bytes -= p->cap;
+		p->cap = p->cap ? p->cap * 2 : 16;
+		p->data = erealloc(p->data, p->cap);
+		x->bytes += p->cap;
+	}
+	for(; d > 0x7f; d >>= 7)
+		p->data[p->len++] = d | 0x80;
+	p->data[p->len++] = d;
+	p->last = block;
+}
+
+/* Give c the next block number and add it to the lists of its trigrams.
+ * seen marks the trigrams found so far and hs lists them, so they are
+ * added once per block. Returns 0 when cancelled. */
+int
+index_chunk(Buffer *b, Chunk *c, unsigned char *seen, unsigned int *hs) {
+	Index *x = &b->index;
+	Line *l;
+	unsigned char *p, *end;
+	unsigned int t, h, n = 0;
+	int i, j, k;
 
-	if (fmt[0] && fmt[strlen(fmt)-1] == ':') {
-		fputc(' ', stderr);
-		perror(NULL);
-	} else {
-		fputc('\n', stderr);
+	for(i = 0; i < c->len && !__atomic_load_n(&x->cancel, __ATOMIC_RELAXED); i++) {
+		l = c->lines[i];
+		if(!l->len)
+			continue;
+		/* both sides of the gap, trigrams do not cross lines */
+		for(j = k = t = 0; j < 2; j++) {
+			p = (unsigned char *)l->buf + (j ? l->gap + l->gaplen : 0);
+			end = p + (j ? l->len - l->gap : l->gap);
+			for(; p < end; p++) {
+				t = (t << 8 | *p) & 0xffffff;
+				if(++k < 3)
+					continue;
+				h = trigram_hash(t);
+				if(!(seen[h / 8] & 1 << h % 8)) {
+					seen[h / 8] |= 1 << h % 8;
+					hs[n++] = h;
+				}
+			}
+		}
 	}
-	exit(0);
+	if(i == c->len)
+		c->block = ++x->nblocks;
+	while(n--) {
+		h = hs[n];
+		seen[h / 8] = 0;
+		if(c->block)
+			posting_add(x, &x->post[h], c->block);
+	}
+	return c->block != 0;
 }
 
-void *
-ecalloc(size_t nmemb, size_t size) {
-	void *p;
+/* number of chunks holding a block number */
+unsigned int
+index_count(Chunk *c) {
+	if(!c)
+		return 0;
+	return index_count(c->left) + (c->block != 0) + index_count(c->right);
+}
 
-	if(!(p = calloc(nmemb, size)))
-		die("Cannot allocate memory.");
-	return p;
+/* take the block numbers off all chunks */
+void
+index_clear(Chunk *c) {
+	for(; c; c = c->right) {
+		c->block = 0;
+		index_clear(c->left);
+	}
+}
+
+/* index the chunks without a number, in order */
+int
+index_walk(Buffer *b, Chunk *c, unsigned char *seen, unsigned int *hs) {
+	if(!c)
+		return 1;
+	return index_walk(b, c->left, seen, hs)
+		&& (c->block || !c->len || index_chunk(b, c, seen, hs))
+		&& index_walk(b, c->right, seen, hs);
 }
 
 void *
-erealloc(void *p, size_t size) {
-	if(!(p = realloc(p, size)))
-		die("Cannot reallocate memory.");
-	return p;
+index_run(void *arg) {
+	Buffer *b = arg;
+	Index *x = &b->index;
+	unsigned char *seen = ecalloc(INDEX_HASH / 8, 1);
+	unsigned int *hs = ecalloc(INDEX_HASH, sizeof(unsigned int));
+	int first = !x->nblocks, done, i;
+
+	x->stale = x->nblocks - index_count(b->root);
+	if(x->stale > x->nblocks / 2) {
+		index_clear(b->root);
+		for(i = 0; i < INDEX_HASH; i++)
+			x->post[i].len = x->post[i].last = 0;
+		x->nblocks = x->stale = 0;
+	}
+	done = index_walk(b, b->root, seen, hs);
+	free(seen);
+	free(hs);
+
+	/* like the loader, drop the pages the first build faulted in */
+	if(done && first && b->map)
+		madvise(b->map, b->map_size, MADV_DONTNEED);
+	pthread_mutex_lock(&b->lock);
+	x->done = done;
+	x->running = 0;
+	pthread_mutex_unlock(&b->lock);
+	ui->wakeup();
+	return NULL;
 }
 
 void
-insert_data(char *dst, char *txt, int txtlen, int len) {
-	memmove(dst + txtlen, dst, len);
-	memcpy(dst, txt, txtlen);
+index_start(Buffer *b) {
+	Index *x = &b->index;
+
+	if(!x->post)
+		x->post = ecalloc(INDEX_HASH, sizeof(Posting));
+	x->running = 1;
+	if(pthread_create(&x->builder, NULL, index_run, b))
+		die("Cannot start the index thread.");
+	x->building = 1;
 }
 
+/* pause the builder, index_poll() starts it over where it stopped */
 void
-delete_char(char *dst, int count, int len) {
-	memmove(dst, dst + count, len);
+index_stop(Buffer *b) {
+	Index *x = &b->index;
+
+	if(!x->building)
+		return;
+	__atomic_store_n(&x->cancel, 1, __ATOMIC_RELAXED);
+	pthread_join(x->builder, NULL);
+	x->building = 0;
+	x->cancel = 0;
 }
 
+/* build the index once the file is in, not while the finders run */
 void
-line_insert_text(Line *line, size_t index, char *txt, int len) {
-	size_t newlen = line->len + len;
+index_poll(Buffer *b) {
+	Index *x = &b->index;
+	int running;
 
-	assert(index >= 0 && index <= line->len);
-	if(newlen > line->cap) {
-		line->cap = line->cap ? line->cap * 2 : 16;
-		line->buf = erealloc(line->buf, line->cap);
+	if(!index_on || b->loading_thread || b->search.finders)
+		return;
+	if(x->building) {
+		pthread_mutex_lock(&b->lock);
+		running = x->running;
+		pthread_mutex_unlock(&b->lock);
+		if(!running) {
+			pthread_join(x->builder, NULL);
+			x->building = 0;
+		}
+	} else if(!x->done) {
+		index_start(b);
 	}
-	insert_data(&line->buf[index], txt, len, line->len - index);
-	line->len = newlen;
+}
+
+/* Bitmap of the blocks holding every trigram of q, so the only ones that
+ * may hold q. NULL when the index can't tell. */
+unsigned long *
+index_lookup(Buffer *b, char *q, int len) {
+	Index *x = &b->index;
+	Posting *p;
+	unsigned long *r, *m;
+	unsigned char *u = (unsigned char *)q;
+	unsigned int block, d, shift, j;
+	size_t words = x->nblocks / LONG_BITS + 1, w;
+	int i;
+
+	if(!x->nblocks || len < 3)
+		return NULL;
+	r = ecalloc(words, sizeof(unsigned long));
+	m = ecalloc(words, sizeof(unsigned long));
+	memset(r, 0xff, words * sizeof(unsigned long));
+	for(i = 0; i + 3 <= len; i++) {
+		p = &x->post[trigram_hash(u[i] << 16 | u[i + 1] << 8 | u[i + 2])];
+		memset(m, 0, words * sizeof(unsigned long));
+		for(j = block = 0; j < p->len; block += d) {
+			for(d = shift = 0; p->data[j] & 0x80; shift += 7)
+				d |= (unsigned int)(p->data[j++] & 0x7f) << shift;
+			d |= (unsigned int)p->data[j++] << shift;
+			m[(block + d) / LONG_BITS] |= 1UL << (block + d) % LONG_BITS;
+		}
+		for(w = 0; w < words; w++)
+			r[w] &= m[w];
+	}
+	free(m);
+	return r;
 }
 
 void
-line_delete_char(Line *line, int index, int count) {
-	delete_char(&line->buf[index],  count, line->len - index);
-	line->len -= count;
+index_release(Buffer *b) {
+	Index *x = &b->index;
+	int i;
+
+	index_stop(b);
+	for(i = 0; x->post && i < INDEX_HASH; i++)
+		free(x->post[i].data);
+	free(x->post);
+	memset(x, 0, sizeof(Index));
 }
 
-Line *
-line_create(char *content) {
-	Line *l = ecalloc(1, sizeof(Line));
+int
+buffer_load_file(Buffer *b) {
+	struct stat st;
+	char *p;
+	int fd;
 
-	if(content) {
-		l->buf = strdup(content);
-		l->len = strlen(l->buf);
-		l->cap = l->len + 1;
+	if((fd = open(b->file_name, O_RDONLY)) == -1)
+		return -1;
+	if(fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
 	}
-	return l;
+	if(st.st_size) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		b->map = p;
+		b->map_size = st.st_size;
+	}
+	close(fd);
+	b->file_size = b->map_size;
+	if(!b->map)
+		return 0;
+
+	/* split lines in the background, wait only for the first screen */
+	b->loading = 1;
+	if(pthread_create(&b->loader, NULL, buffer_loader, b))
+		die("Cannot start the loader thread.");
+	b->loading_thread = 1;
+	pthread_mutex_lock(&b->lock);
+	while(b->loading && !b->batches)
+		pthread_cond_wait(&b->cond, &b->lock);
+	pthread_mutex_unlock(&b->lock);
+	buffer_poll(b);
+	return 0;
 }
 
-void
-line_destroy(Line *l) {
-	if(l->buf)
-		free(l->buf);
-	free(l);
-}
+void *
+buffer_loader(void *arg) {
+	Buffer *b = arg;
+	Scan *scans, first;
+	char *p, *s, *e, *nl, *end = b->map + b->map_size;
+	size_t n, i;
+
+	/* lines point straight into the mapping (see line_own()) */
+	madvise(b->map, b->map_size, MADV_SEQUENTIAL);
+
+	/* the first screen goes out on its own */
+	for(p = b->map, i = 0; p < end && i < LOAD_FIRST; i++)
+		p = (p = memchr(p, '\n', end - p)) ? p + 1 : end;
+	memset(&first, 0, sizeof(Scan));
+	first.b = b;
+	first.start = b->map;
+	first.end = p;
+	first.direct = 1;
+	buffer_scan(&first);
+
+	/* split the rest at line boundaries, one range per core */
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > (end - p) / LOAD_SPLIT + 1)
+		n = (end - p) / LOAD_SPLIT + 1;
+	if(n > LOAD_THREADS)
+		n = LOAD_THREADS;
+	if(n < 1)
+		n = 1;
+	scans = ecalloc(n, sizeof(Scan));
+	for(i = 0, s = p; i < n; i++, s = e) {
+		e = p + (end - p) * (i + 1) / n;
+		if(e < s)
+			e = s;
+		else if(e > s && e[-1] != '\n')
+			e = (nl = memchr(e, '\n', end - e)) ? nl + 1 : end;
+		scans[i].b = b;
+		scans[i].start = s;
+		scans[i].end = e;
+		scans[i].tail = &scans[i].batches;
+	}
 
-void
-buffer_insert_line(Buffer *b, int index, Line *line) {
-	size_t nb = (b->lines_tot - index) * sizeof(Line *);
+	/* the first range is published while it is scanned, the others are
+	 * handed over in order as their threads finish */
+	scans[0].direct = 1;
+	for(i = 1; i < n; i++)
+		if(pthread_create(&scans[i].tid, NULL, buffer_scan, &scans[i]))
+			die("Cannot start a scanner thread.");
+	buffer_scan(&scans[0]);
+	for(i = 1; i < n; i++) {
+		pthread_join(scans[i].tid, NULL);
+		buffer_publish(b, scans[i].batches, scans[i].end - b->map, 0);
+	}
+	free(scans);
 
-	assert(index >= 0 && index <= b->lines_tot);
-	if(b->lines_tot >= b->lines_cap) {
-		b->lines_cap = b->lines_cap ? b->lines_cap * 2 : 64;
-		b->lines = erealloc(b->lines, sizeof(Line *) * b->lines_cap);
+	/* the scan faulted in every page, drop them until they get viewed */
+	madvise(b->map, b->map_size, MADV_DONTNEED);
+	madvise(b->map, b->map_size, MADV_RANDOM);
+	buffer_publish(b, NULL, b->map_size, 1);
+	return NULL;
+}
+
+/* split a range of the mapping into lines */
+void *
+buffer_scan(void *arg) {
+	Scan *s = arg;
+	Batch *bt = NULL;
+	char *p, *nl;
+
+	for(p = s->start; p < s->end && !__atomic_load_n(&s->b->load_cancel, __ATOMIC_RELAXED); p = nl + 1) {
+		if(!bt)
+			bt = ecalloc(1, sizeof(Batch) + LOAD_BATCH * sizeof(Line *));
+		if(!(nl = memchr(p, '\n', s->end - p)))
+			nl = s->end;
+		bt->lines[bt->n++] = line_create_ref(&bt->arena, p, nl - p);
+		if(bt->n == LOAD_BATCH || nl + 1 >= s->end) {
+			if(s->direct) {
+				buffer_publish(s->b, bt, nl + 1 - s->b->map, 0);
+			} else {
+				*s->tail = bt;
+				s->tail = &bt->next;
+			}
+			bt = NULL;
+		}
 	}
-	if(nb)
-		memmove(b->lines + index + 1, b->lines + index, nb);
-	b->lines[index] = line;
-	++b->lines_tot;
+	if(bt) {
+		arena_release(&bt->arena);
+		free(bt);
+	}
+	return NULL;
 }
 
+/* hand a list of batches over to the main thread and wake it up */
 void
-buffer_delete_line(Buffer *b, int index, int count) {
-	if(index < 0 || index >= b->lines_tot) return;
-	if(index + count > b->lines_tot) count = b->lines_tot - index;
+buffer_publish(Buffer *b, Batch *bt, size_t pos, int done) {
+	int wake;
 
-	/* do not remove the only existing line (but clear it) */
-	if(b->lines_tot == 1 && !index) {
-		b->lines[0]->len = 0;
-		return;
+	pthread_mutex_lock(&b->lock);
+	for(; bt; bt = bt->next) {
+		*b->batches_tail = bt;
+		b->batches_tail = &bt->next;
 	}
+	b->load_pos = pos;
+	if(done)
+		b->loading = 0;
+	wake = !b->load_woken;
+	b->load_woken = 1;
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+	if(wake)
+		ui->wakeup();
+}
 
-	for (int i = 0; i < count; i++)
-		line_destroy(b->lines[index + i]);
+/* append the lines published by the loader */
+void
+buffer_poll(Buffer *b) {
+	Batch *bt, *next;
+	int loading;
+
+	pthread_mutex_lock(&b->lock);
+	bt = b->batches;
+	b->batches = NULL;
+	b->batches_tail = &b->batches;
+	b->load_woken = 0;
+	loading = b->loading;
+	b->load_shown = b->load_pos;
+	pthread_mutex_unlock(&b->lock);
+
+	for(; bt; bt = next) {
+		next = bt->next;
+		arena_merge(&b->arena, &bt->arena);
+		buffer_splice(b, b->load_next, chunk_build(bt->lines, bt->n));
+		free(bt);
+	}
+	if(!loading && b->loading_thread) {
+		pthread_join(b->loader, NULL);
+		b->loading_thread = 0;
+	}
+}
 
-	int remaining = b->lines_tot - (index + count);
-	if (remaining > 0)
-		memmove(b->lines + index, b->lines + index + count, remaining * sizeof(Line *));
-	b->lines_tot -= count;
+/* block until the whole file is in */
+void
+buffer_wait_load(Buffer *b) {
+	pthread_mutex_lock(&b->lock);
+	while(b->loading)
+		pthread_cond_wait(&b->cond, &b->lock);
+	pthread_mutex_unlock(&b->lock);
+	buffer_poll(b);
 }
 
+/* Write the buffer to a temporary file next to the original and rename it
+ * over. The iovecs point straight at the line text (both sides of the gap)
+ * so nothing gets copied on our side, and runs of lines still in the file
+ * mapping collapse into a single iovec. */
 int
-buffer_load_file(Buffer *b) {
-	Line *l;
-	FILE *fp;
-	char *buf = NULL;
-	size_t cap;
-	int len;
+buffer_save(Buffer *b) {
+	static char nl = '\n';
+	struct iovec iov[SAVE_IOV];
+	struct stat st;
+	mode_t mode;
+	char *tmp, *s;
+	Line **lines, *l;
+	size_t i = 0, bytes = 0;
+	long start = now_msec();
+	int fd, n = 0, k, m, len, calls = 0;
+
+	if(!b->file_name) {
+		set_msg("no file name");
+		return -1;
+	}
+	buffer_wait_load(b);
 
-	if(!(fp = fopen(b->file_name, "r")))
+	tmp = ecalloc(1, strlen(b->file_name) + 8);
+	sprintf(tmp, "%s.XXXXXX", b->file_name);
+	if((fd = mkstemp(tmp)) == -1) {
+		set_msg("cannot save: %s", strerror(errno));
+		free(tmp);
 		return -1;
-	while((len = getline(&buf, &cap, fp)) != -1) {
-		if(len && buf[len-1] == '\n') buf[len - 1] = 0;
-		b->file_size += len;
-		l = line_create(buf);
-		buffer_insert_line(b, b->lines_tot, l);
 	}
-	fclose(fp);
+	++calls;
+	/* keep the mode of the file replaced, a new one gets the umask */
+	if(!stat(b->file_name, &st)) {
+		mode = st.st_mode & 07777;
+	} else {
+		mode = umask(0);
+		umask(mode);
+		mode = 0666 & ~mode;
+	}
+	if(fchmod(fd, mode))
+		goto fail;
+
+	/* a lone empty line is an empty file, unless it came from one with
+	 * just a newline */
+	if(b->lines_tot == 1 && !buffer_get_line(b, 0)->len && !b->file_size)
+		i = b->lines_tot;
+	while(i < b->lines_tot) {
+		for(k = buffer_get_lines(b, i, &lines); k; k--, i++) {
+			l = *lines++;
+			for(len = 0; len < l->len; len += m) {
+				s = line_span(l, len, &m);
+				iov_add(iov, &n, s, m);
+			}
+			/* untouched lines are still followed by their newline */
+			s = l->buf + l->len;
+			if(l->cap || s < b->map || s >= b->map + b->map_size || *s != '\n')
+				s = &nl;
+			iov_add(iov, &n, s, 1);
+			bytes += l->len + 1;
+			if(n > SAVE_IOV - 3) { /* no room for another line */
+				if(write_iov(fd, iov, n, &calls))
+					goto fail;
+				n = 0;
+			}
+		}
+	}
+	if(n && write_iov(fd, iov, n, &calls))
+		goto fail;
+	if(fsync(fd))
+		goto fail;
+	k = close(fd);
+	fd = -1;
+	if(k)
+		goto fail;
+	calls += 2;
+	if(rename(tmp, b->file_name))
+		goto fail;
+	++calls;
+
+	/* the rename is only durable once the directory is synced */
+	if((s = strrchr(tmp, '/')))
+		s[s == tmp] = '\0';
+	else
+		strcpy(tmp, ".");
+	if((fd = open(tmp, O_RDONLY | O_DIRECTORY)) == -1 || fsync(fd)) {
+		set_msg("saved, cannot sync %s: %s", tmp, strerror(errno));
+		if(fd != -1)
+			close(fd);
+		free(tmp);
+		return -1;
+	}
+	close(fd);
+	calls += 3;
+	free(tmp);
+
+	b->file_size = bytes;
+	start = now_msec() - start;
+	set_msg("wrote %zu bytes in %ld ms (%.1f MB/s, %d syscalls)", bytes, start,
+		start ? bytes / 1000.0 / start : 0.0, calls);
+	return 0;
+
+fail:
+	set_msg("cannot save: %s", strerror(errno));
+	if(fd != -1)
+		close(fd);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+/* append a span, merging it with the previous one if adjacent */
+void
+iov_add(struct iovec *iov, int *n, char *s, size_t len) {
+	struct iovec *last;
+
+	if(*n) {
+		last = &iov[*n - 1];
+		if((char *)last->iov_base + last->iov_len == s) {
+			last->iov_len += len;
+			return;
+		}
+	}
+	iov[*n].iov_base = s;
+	iov[(*n)++].iov_len = len;
+}
+
+/* writev() all of iov, going on after short writes */
+int
+write_iov(int fd, struct iovec *iov, int n, int *calls) {
+	ssize_t r;
+
+	while(n) {
+		if((r = writev(fd, iov, n)) == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		++*calls;
+		for(; n && r >= iov->iov_len; n--, iov++)
+			r -= iov->iov_len;
+		if(n) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
 	return 0;
 }
 
 Line *
 buffer_get_line(Buffer *b, int index) {
+	size_t i = index;
+	Chunk *c;
+
 	if(index < 0 || index >= b->lines_tot)
 		return NULL;
-	return b->lines[index];
+	c = chunk_find(b->root, &i);
+	return c->lines[i];
+}
+
+/* point lines at index and return how many follow it contiguously */
+int
+buffer_get_lines(Buffer *b, int index, Line ***lines) {
+	size_t i = index;
+	Chunk *c;
+
+	if(index < 0 || index >= b->lines_tot)
+		return 0;
+	c = chunk_find(b->root, &i);
+	*lines = c->lines + i;
+	return c->len - i;
 }
 
 Buffer *
 buffer_create(char *fn) {
 	Buffer *b = ecalloc(1, sizeof(Buffer));
+	char *p;
+	int i;
 
-	b->lines = NULL;
+	b->root = NULL;
 	b->lines_tot = 0;
 	b->file_size = 0;
+	b->ref_count = 1;
+	if(fn && (p = strrchr(fn, '.')))
+		for(i = 0; i < LENGTH(hl_exts); i++)
+			b->syntax |= !strcmp(p, hl_exts[i]);
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	b->batches_tail = &b->batches;
 	if(fn) {
 		if(!(b->file_name = strdup(fn)))
 			return NULL;
@@ -234,44 +3044,87 @@ buffer_create(char *fn) {
 	}
 
 	/* ensure we have at least a line */
-	if(!b->lines_tot) buffer_insert_line(b, 0, line_create(NULL));
+	if(!b->lines_tot) buffer_insert_line(b, 0, line_create(&b->arena, NULL, 0));
 
+	b->undo.max = undo_max; /* log from now on */
 	return b;
 }
 
+/* drop a reference, the last one frees the buffer */
 void
 buffer_destroy(Buffer *b) {
-	int i;
+	Batch *bt;
 
-	if(b->lines) {
-		for(i = 0; i < b->lines_tot; i++)
-			line_destroy(b->lines[i]);
-		free(b->lines);
+	if(--b->ref_count)
+		return;
+	if(b->loading_thread) {
+		__atomic_store_n(&b->load_cancel, 1, __ATOMIC_RELAXED);
+		pthread_join(b->loader, NULL);
 	}
+	while((bt = b->batches)) {
+		b->batches = bt->next;
+		arena_release(&bt->arena);
+		free(bt);
+	}
+	search_stop(b);
+	free(b->search.m);
+	index_release(b);
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->cond);
+	chunk_free(b->root, NULL);
+	undo_release(b);
+	arena_release(&b->arena);
+	if(b->map)
+		munmap(b->map, b->map_size);
 	if(b->file_name)
 		free(b->file_name);
 	free(b);
 }
 
+/* a view of b taking the whole screen, see view_resize() */
 View *
 view_create(Buffer *b) {
 	View *v = ecalloc(1, sizeof(View));
+	int rows, cols;
 
 	v->line_idx = 0;
 	v->col_idx = 0;
 	v->row_off = 0;
 	v->col_off = 0;
+	v->dmg_from = INT_MAX;
+	v->dmg_to = -1;
 	v->buf = b;
+	v->next = b->views;
+	b->views = v;
+	++b->ref_count;
 
-	ui->get_window_size(&v->screen_rows, &v->screen_cols);
+	ui->get_window_size(&rows, &cols);
+	view_resize(v, 0, 0, rows - 1, cols); /* status line */
 	return v;
 }
 
 void
 view_destroy(View *v) {
+	View **p;
+
+	for(p = &v->buf->views; *p != v; p = &(*p)->next);
+	*p = v->next;
+	buffer_destroy(v->buf);
+	free(v->rows);
 	free(v);
 }
 
+void
+view_resize(View *v, int x, int y, int rows, int cols) {
+	if(rows != v->screen_rows || !v->rows)
+		v->rows = erealloc(v->rows, (rows > 0 ? rows : 1) * sizeof(ViewRow));
+	v->x = x;
+	v->y = y;
+	v->screen_rows = rows;
+	v->screen_cols = cols;
+	v->redraw = 1;
+}
+
 void
 view_cursor_fix(View *v) {
 	/* Note: if called together then vfix must always be called first */
@@ -282,7 +3135,7 @@ view_cursor_fix(View *v) {
 /* actual invariant for the cursor */
 void
 view_cursor_hfix(View *v) {
-	Line *l = v->buf->lines[v->line_idx];
+	Line *l = buffer_get_line(v->buf, v->line_idx);
 
 	if (v->col_idx < 0) v->col_idx = 0;
 	if (v->col_idx > l->len) v->col_idx = l->len;
@@ -305,10 +3158,17 @@ view_cursor_left(View *v) {
 
 void
 view_cursor_right(View *v) {
-	Line *l = v->buf->lines[v->line_idx];
+	Line *l = buffer_get_line(v->buf, v->line_idx);
 
 	if(v->col_idx < l->len) {
-		int len = ui->text_len(l->buf + v->col_idx, l->len - v->col_idx);
+		Layout *lo;
+		int len;
+
+		if((lo = line_layout(v->buf, l))) {
+			v->col_idx = lo->idx[layout_find(lo, v->col_idx + 1)];
+			return;
+		}
+		line_cluster(l, v->col_idx, &len);
 		v->col_idx += len;
 	}
 }
@@ -333,13 +3193,27 @@ int
 view_idx2col(View *v, Line *line, int target_idx) {
 	int x = 0;
 	int i = 0;
-	size_t len;
+	int len;
+	char *p;
+	Layout *lo;
 
 	if (target_idx > line->len) target_idx = line->len;
+	if((lo = line_marks(v->buf, line, target_idx, INT_MAX))) {
+		if(!lo->sparse)
+			return lo->col[layout_find(lo, target_idx)];
+		i = marks_find(lo, target_idx);
+		x = lo->col[i];
+		i = lo->idx[i];
+	}
 
 	while(i < target_idx) {
-		len = ui->text_len(line->buf + i, line->len - i);
-		x += ui->text_width(line->buf + i, len, x);
+		if((len = line_run(line, i, target_idx - i))) {
+			x += len;
+			i += len;
+			continue;
+		}
+		p = line_cluster(line, i, &len);
+		x += ui->text_width(p, len, x);
 		i += len;
 	}
 	return x;
@@ -347,22 +3221,73 @@ view_idx2col(View *v, Line *line, int target_idx) {
 
 void
 view_scroll_fix(View *v) {
+	Line *l = buffer_get_line(v->buf, v->line_idx);
+	int vx = view_idx2col(v, l, v->col_idx);
+	int r;
+
+	if(v->wrap) {
+		/* keep the row of the cursor between the anchor and the
+		 * bottom, only walking the lines on screen */
+		v->col_off = 0;
+		r = line_row_at(v, l, vx);
+		if(v->row_off >= v->buf->lines_tot)
+			v->row_off = v->buf->lines_tot - 1;
+		if(v->row_sub >= line_rows(v, buffer_get_line(v->buf, v->row_off)))
+			v->row_sub = 0;
+		if(v->line_idx < v->row_off || (v->line_idx == v->row_off && r < v->row_sub)) {
+			v->row_off = v->line_idx;
+			v->row_sub = r;
+		} else if(view_rows_between(v, v->row_off, v->row_sub, v->line_idx, r,
+		v->screen_rows) >= v->screen_rows) {
+			view_anchor_above(v, v->line_idx, r, v->screen_rows - 1);
+		}
+		return;
+	}
+
 	/* vertical */
+	v->row_sub = 0;
 	if (v->line_idx < v->row_off)
 		v->row_off = v->line_idx;
 	if (v->line_idx >= v->row_off + v->screen_rows)
 		v->row_off = v->line_idx - v->screen_rows + 1;
 
 	/* horizontal */
-	Line *l = buffer_get_line(v->buf, v->line_idx);
-	int vx = view_idx2col(v, l, v->col_idx);
-
 	if(vx < v->col_off)
 		v->col_off = vx;
 	if(vx >= v->col_off + v->screen_cols)
 		v->col_off = vx - v->screen_cols + 1;
 }
 
+/* Screen rows from row s1 of line l1 down to row s2 of line l2, at most
+ * max. Never rows above the first, so the cost is bounded by the screen. */
+int
+view_rows_between(View *v, int l1, int s1, int l2, int s2, int max) {
+	Line *l;
+	int n;
+
+	if(l1 == l2)
+		return s2 - s1 < max ? s2 - s1 : max;
+	l = buffer_get_line(v->buf, l1);
+	n = (l ? line_rows(v, l) : 1) - s1;
+	while(++l1 < l2 && n < max) {
+		l = buffer_get_line(v->buf, l1);
+		n += l ? line_rows(v, l) : 1;
+	}
+	n += s2;
+	return n < max ? n : max;
+}
+
+/* put the top of the view n rows above row sub of line */
+void
+view_anchor_above(View *v, int line, int sub, int n) {
+	while(n > sub && line > 0) {
+		n -= sub + 1;
+		sub = line_rows(v, buffer_get_line(v->buf, --line)) - 1;
+	}
+	v->row_off = line;
+	v->row_sub = n > sub ? 0 : sub - n;
+}
+
 int
 measure_span(char *s, int slen, int start_x) {
 	int x = start_x;
@@ -376,13 +3301,47 @@ measure_span(char *s, int slen, int start_x) {
 }
 
 int
-render(Cell *cells, char *buf, int buflen, int xoff, int cols) {
-	int nc = 0, vx = 0, i = 0;
+render(Cell *cells, Line *l, Layout *lo, int xoff, int cols) {
+	int nc = 0, vx = 0, i = 0, k = 0, run = 0, sp = 0, ap = 0;
 	int w, len, x;
+	char *p;
+
+	/* with a layout start right at the first visible cluster, or at the
+	 * last checkpoint before it */
+	if(lo) {
+		k = layout_find_col(lo, xoff);
+		i = lo->idx[k];
+		vx = lo->col[k];
+		if(lo->sparse)
+			lo = NULL;
+	}
 
-	while(i < buflen) {
-		len = ui->text_len(buf + i, buflen - i);
-		w = ui->text_width(buf + i, len, vx);
+	while(i < l->len) {
+		if(lo) {
+			len = lo->idx[k + 1] - i;
+			w = lo->col[k + 1] - vx;
+			p = line_bytes(l, i, len);
+			++k;
+		} else {
+			/* runs of one-cell bytes are skipped or emitted directly */
+			if(!run && (run = line_run(l, i, xoff - vx + cols))) {
+				if(vx < xoff) {
+					x = xoff - vx < run ? xoff - vx : run;
+					vx += x;
+					i += x;
+					run -= x;
+					continue;
+				}
+			}
+			if(run) {
+				p = line_bytes(l, i, 1);
+				len = w = 1;
+				--run;
+			} else {
+				p = line_cluster(l, i, &len);
+				w = ui->text_width(p, len, vx);
+			}
+		}
 
 		/* horizontal scroll skip */
 		if(vx + w <= xoff) goto next;
@@ -390,12 +3349,21 @@ render(Cell *cells, char *buf, int buflen, int xoff, int cols) {
 		if(x >= cols) break; /* screen has been filled */
 
 		if(len > CELL_POOL_THRESHOLD)
-			cells[nc].data.pool_idx = textpool_insert(&ui->pool, buf + i, len);
+			cells[nc].data.pool_idx = textpool_insert(&ui->pool, p, len);
 		else
-			memcpy(cells[nc].data.text, buf + i, len);
+			memcpy(cells[nc].data.text, p, len);
 
 		cells[nc].len = len;
 		cells[nc].flags = 0;
+		cells[nc].attr = ATTR_NONE;
+		while(sp < nspans && spans[sp].end <= i)
+			++sp;
+		if(sp < nspans && spans[sp].start < i + len)
+			cells[nc].flags |= spans[sp].flags;
+		while(ap < nattrs && attrs[ap].end <= i)
+			++ap;
+		if(ap < nattrs && attrs[ap].start < i + len)
+			cells[nc].attr = attrs[ap].attr;
 
 		if(x + w > cols) {
 			cells[nc].flags |= CELL_TRUNC_R;
@@ -420,49 +3388,374 @@ next:
 	return nc;
 }
 
+/* rows the view moved down since the last frame, SCROLL_MAX if far */
+int
+view_scroll_delta(View *v) {
+	int l1 = v->drawn_row_off, s1 = v->drawn_row_sub;
+	int l2 = v->row_off, s2 = v->row_sub;
+
+	/* rows above may have been rewrapped */
+	if(v->wrap && v->dmg_from <= v->dmg_to && (l1 != l2 || s1 != s2))
+		return SCROLL_MAX(v);
+	if(l1 > l2 || (l1 == l2 && s1 > s2))
+		return -view_rows_between(v, l2, s2, l1, s1, SCROLL_MAX(v));
+	return view_rows_between(v, l1, s1, l2, s2, SCROLL_MAX(v));
+}
+
 /* TODO: is this the cleaner way to do it? */
 void
 view_place_cursor(View *v) {
 	Line *l;
-	int x, y;
+	int x, y, r, w;
 
 	l = buffer_get_line(v->buf, v->line_idx);
 	if(l) {
 		x = view_idx2col(v, l, v->col_idx);
 		x -= v->col_off;
 		y = v->line_idx - v->row_off;
+		if(v->wrap) {
+			r = line_row_at(v, l, x);
+			x -= line_row(v, l, r, &w);
+			y = view_rows_between(v, v->row_off, v->row_sub, v->line_idx, r,
+				v->screen_rows);
+			if(x >= v->screen_cols)
+				x = v->screen_cols - 1;
+		}
 	} else {
 		x = y = 0;
 	}
-	ui->move_cursor(x, y);
+	ui->move_cursor(v->x + x, v->y + y);
 }
 
+/* Scroll v into place and bring the lexer states of its lines up to date.
+ * Done for every view before any is prepared, the lines of the others may
+ * get damaged. */
 void
-draw_view(View *v) {
+view_update(View *v) {
+	uint64_t t;
+
+	t = lat_start();
+	view_cursor_fix(v);
+	view_scroll_fix(v);
+	lat_stop(LAT_SCROLL, t);
+	if(v->buf->syntax) {
+		t = lat_start();
+		hl_update(v->buf, v->row_off, v->row_off + v->screen_rows - 1);
+		lat_stop(LAT_RENDER, t);
+	}
+}
+
+/* Work out what the rows of v show. Only rows showing damaged lines need
+ * to be rendered again. Small vertical scrolls of views as wide as the
+ * screen are left to the terminal, then only the exposed rows are drawn. */
+void
+view_prepare(View *v, int scroll) {
+	Buffer *b = v->buf;
 	Line *l;
-	int row, y, nc;
+	int row, sub, y, d, dmg, shift;
+
+	d = view_scroll_delta(v);
+	if(v->col_off != v->drawn_col_off || d >= SCROLL_MAX(v) || -d >= SCROLL_MAX(v))
+		v->redraw = 1;
+	else if(d && !v->redraw && scroll)
+		ui->scroll(v->y, v->y + v->screen_rows, d);
+	else if(d)
+		v->redraw = 1;
+	row = v->row_off;
+	sub = v->row_sub;
+	for(y = 0, shift = 0; y < v->screen_rows; y++) {
+		l = buffer_get_line(b, row);
+		dmg = row >= v->dmg_from && row <= v->dmg_to;
+		shift |= dmg && v->wrap; /* the rows below may have moved */
+		v->rows[y].line = l;
+		v->rows[y].sub = sub;
+		v->rows[y].draw = v->redraw || dmg || shift
+			|| (d > 0 && y >= v->screen_rows - d) || (d < 0 && y < -d);
+		if(v->rows[y].draw && b->syntax)
+			v->rows[y].state = hl_start(b, row);
+		if(!l || ++sub >= line_rows(v, l)) {
+			++row;
+			sub = 0;
+		}
+	}
+
+	v->drawn_row_off = v->row_off;
+	v->drawn_row_sub = v->row_sub;
+	v->drawn_col_off = v->col_off;
+	v->redraw = 0;
+	v->dmg_from = INT_MAX;
+	v->dmg_to = -1;
+}
+
+/* the cells of row y of v, the status line below the last one */
+int
+view_render_row(View *v, int y, Cell *cells) {
+	ViewRow *r = &v->rows[y];
+	uint64_t t;
+	int x, w, nc;
+
+	if(y == v->screen_rows)
+		return draw_status(v, cells);
+	if(!r->line) {
+		memset(cells, 0, sizeof(Cell));
+		cells->data.text[0] = '~';
+		cells->len = cells->width = 1;
+		return 1;
+	}
+	x = v->col_off;
+	w = v->screen_cols;
+	if(v->wrap)
+		x = line_row(v, r->line, r->sub, &w);
+	t = lat_start();
+	line_matches(v->buf, r->line, x, w);
+	if(v->buf->syntax)
+		line_highlight(v->buf, r->line, r->state, x, w);
+	nc = render(cells, r->line, line_marks(v->buf, r->line, INT_MAX, x), x, w);
+	nspans = nattrs = 0;
+	lat_stop(LAT_RENDER, t);
+	return nc;
+}
+
+/* A frame of the views vs, in screen order. Screen rows are put together
+ * from the views side by side on them and go out whole, the UI only sends
+ * the cells that changed. */
+void
+draw_views(View **vs, int n) {
+	View *v, *cur = vs[0];
+	uint64_t t;
+	size_t bytes;
+	int rows, cols, x, y, i, k, nc, need;
 
 	ui->pool.len = 0;
 	ui->frame_start();
-	view_scroll_fix(v);
-
-	Cell *cells = ecalloc(1, sizeof(Cell) * v->screen_cols);
+	ui->get_window_size(&rows, &cols);
+	if(cols > row_cells_cap) {
+		row_cells_cap = cols;
+		row_cells = erealloc(row_cells, cols * sizeof(Cell));
+	}
+	for(i = 0; i < n; i++)
+		view_update(vs[i]);
+	for(i = 0; i < n; i++) {
+		view_prepare(vs[i], !vs[i]->x && vs[i]->screen_cols == cols);
+		if(vs[i] == vcur)
+			cur = vcur;
+	}
 
-	for(y = 0; y < v->screen_rows; y++) {
-		row = v->row_off + y;
-		l = buffer_get_line(v->buf, row);
-		if(!l) {
-			ui->draw_symbol(0, y, SYM_EMPTYLINE);
+	for(y = 0; y < rows; y++) {
+		for(i = need = 0; i < n && !need; i++) {
+			v = vs[i];
+			need = y == v->y + v->screen_rows
+				|| (y >= v->y && y < v->y + v->screen_rows && v->rows[y - v->y].draw);
+		}
+		if(!need)
 			continue;
+		for(i = nc = x = 0; i < n; i++) {
+			v = vs[i];
+			if(y < v->y || y > v->y + v->screen_rows)
+				continue;
+			/* pad up to the view, a bar separates it from the left one */
+			for(; x < v->x; x++, nc++) {
+				memset(&row_cells[nc], 0, sizeof(Cell));
+				row_cells[nc].data.text[0] = x == v->x - 1 ? '|' : ' ';
+				row_cells[nc].len = row_cells[nc].width = 1;
+			}
+			k = view_render_row(v, y - v->y, row_cells + nc);
+			for(; k; k--, nc++)
+				x += row_cells[nc].width;
 		}
-		nc = render(cells, l->buf, l->len, v->col_off, v->screen_cols);
-		ui->draw_line(ui, 0, y, cells, nc);
+		t = lat_start();
+		ui->draw_line(ui, 0, y, row_cells, nc);
+		lat_stop(LAT_DRAW, t);
 	}
 
-	free(cells);
-
-	view_place_cursor(v);
+	view_place_cursor(cur);
+	bytes = ui->written;
+	t = lat_start();
 	ui->frame_flush();
+	lat_stop(LAT_FLUSH, t);
+	lat_frame_done(ui->written - bytes);
+}
+
+/* a frame of v alone */
+void
+draw_view(View *v) {
+	draw_views(&v, 1);
+}
+
+int
+draw_status(View *v, Cell *cells) {
+	Buffer *b = v->buf;
+	char buf[512];
+	Line l;
+	int n;
+
+	n = snprintf(buf, sizeof buf, "%s  %d:%d/%zu",
+		b->file_name ? b->file_name : "[scratch]",
+		v->line_idx + 1, v->col_idx + 1, b->lines_tot);
+	if(b->loading_thread)
+		n += snprintf(buf + n, sizeof buf - n, "  loading %d%%",
+			(int)(100.0 * b->load_shown / b->map_size));
+	else if(b->index.building)
+		n += snprintf(buf + n, sizeof buf - n, "  indexing");
+	if((searching && v == vcur) || b->search.len)
+		n += snprintf(buf + n, sizeof buf - n, "  /%.*s", b->search.len, b->search.query);
+	if(b->search.len && n < sizeof buf)
+		n += b->search.done
+			? snprintf(buf + n, sizeof buf - n, " (%zu)", b->search.count)
+			: snprintf(buf + n, sizeof buf - n, " (...)");
+	if(msg[0] && v == vcur && n < sizeof buf)
+		n += snprintf(buf + n, sizeof buf - n, "  %s", msg);
+	if(n >= sizeof buf)
+		n = sizeof buf - 1;
+
+	memset(&l, 0, sizeof(Line));
+	l.buf = buf;
+	l.len = l.gap = n;
+	return render(cells, &l, NULL, 0, v->screen_cols);
+}
+
+Frame *
+frame_create(View *v) {
+	Frame *f = ecalloc(1, sizeof(Frame));
+
+	f->view = v;
+	return f;
+}
+
+/* the leaf of f holding v */
+Frame *
+frame_find(Frame *f, View *v) {
+	Frame *r;
+
+	if(!f || f->view == v)
+		return f;
+	return (r = frame_find(f->kid[0], v)) ? r : frame_find(f->kid[1], v);
+}
+
+/* frees the frames and their views */
+void
+frame_free(Frame *f) {
+	if(!f)
+		return;
+	frame_free(f->kid[0]);
+	frame_free(f->kid[1]);
+	if(f->view)
+		view_destroy(f->view);
+	free(f);
+}
+
+/* give the views of f the rectangle at x, y and append them to views */
+void
+frame_layout(Frame *f, int x, int y, int rows, int cols) {
+	int n;
+
+	if(f->view) {
+		view_resize(f->view, x, y, rows - 1, cols); /* status line */
+		if(nviews == views_cap) {
+			views_cap = views_cap ? views_cap * 2 : 8;
+			views = erealloc(views, views_cap * sizeof(View *));
+		}
+		views[nviews++] = f->view;
+	} else if(f->vertical) {
+		n = (cols - 1) / 2; /* and a column for the bar */
+		frame_layout(f->kid[0], x, y, rows, n);
+		frame_layout(f->kid[1], x + n + 1, y, rows, cols - n - 1);
+	} else {
+		n = rows / 2;
+		frame_layout(f->kid[0], x, y, n, cols);
+		frame_layout(f->kid[1], x, y + n, rows - n, cols);
+	}
+}
+
+void
+layout(void) {
+	int rows, cols;
+
+	ui->get_window_size(&rows, &cols);
+	nviews = 0;
+	frame_layout(frames, 0, 0, rows, cols);
+}
+
+/* Split the frame of v in two, the new half goes above or left of it and
+ * shows the same buffer from the same place. */
+int
+window_split(View *v, int vertical) {
+	Frame *f = frame_find(frames, v);
+	View *n;
+
+	if(vertical ? v->screen_cols < 3 : v->screen_rows < 3)
+		return 0;
+	n = view_create(v->buf);
+	n->line_idx = v->line_idx;
+	n->col_idx = v->col_idx;
+	n->row_off = v->row_off;
+	n->row_sub = v->row_sub;
+	n->col_off = v->col_off;
+	n->wrap = v->wrap;
+	f->vertical = vertical;
+	f->kid[0] = frame_create(n);
+	f->kid[1] = frame_create(v);
+	f->kid[0]->parent = f->kid[1]->parent = f;
+	f->view = NULL;
+	vcur = n;
+	layout();
+	return 1;
+}
+
+/* the other half takes the place of the frame of v */
+int
+window_close(View *v) {
+	Frame *f = frame_find(frames, v), *p = f->parent, *o, *up;
+
+	if(!p)
+		return 0;
+	if(vcur == v)
+		vcur = NULL;
+	o = p->kid[p->kid[0] == f];
+	up = p->parent;
+	*p = *o;
+	p->parent = up;
+	if(p->kid[0])
+		p->kid[0]->parent = p->kid[1]->parent = p;
+	free(o);
+	frame_free(f);
+	layout();
+	if(!vcur)
+		vcur = views[0];
+	return 1;
+}
+
+/* the key after CTRL('w'): split, go to the next view or close it */
+void
+window_cmd(int key) {
+	int i;
+
+	switch(key) {
+	case 's':
+	case 'v':
+		if(!window_split(vcur, key == 'v'))
+			set_msg("no room to split");
+		break;
+	case 'w':
+	case CTRL('w'):
+		for(i = 0; views[i] != vcur; i++);
+		vcur = views[(i + 1) % nviews];
+		break;
+	case 'c':
+	case 'q':
+		if(!window_close(vcur))
+			set_msg("last view");
+		break;
+	}
+}
+
+void
+set_msg(const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof msg, fmt, ap);
+	va_end(ap);
 }
 
 void
@@ -495,36 +3788,93 @@ cell_get_text(Cell *c, char *pool_base) {
 void
 run(void) {
 	Event ev;
+	uint64_t t;
+	long drawn = now_msec();
+	int i;
 
 	while(running) {
 		ev = ui->next_event();
+		t = lat_start();
+		if(ev.type == EV_KEY || ev.type == EV_PASTE)
+			undo_seal(vcur->buf);
 		switch(ev.type) {
 		case EV_KEY:
-			if(ev.key == 'k') view_cursor_up(vcur);
+			if(searching) {
+				search_key(vcur, ev.key);
+				break;
+			}
+			if(window_key) {
+				window_key = 0;
+				window_cmd(ev.key);
+				break;
+			}
+			/* the escape key only ends a search */
+			if(ev.key == 0x1b)
+				break;
+			if(ev.key == CTRL('w')) window_key = 1;
+			else if(ev.key == 'k') view_cursor_up(vcur);
 			else if(ev.key == 'p') {
-				Line *l = vcur->buf->lines[vcur->line_idx];
+				Line *l = buffer_get_line(vcur->buf, vcur->line_idx);
 				fprintf(stderr, "debug current line (%d):\n", vcur->line_idx);
 				fprintf(stderr, "=== START LINE ===\n");
 
 				unsigned int cp;
-				utf8_decode(l->buf, l->len, &cp);
+				char *txt = line_bytes(l, 0, l->len);
+				utf8_decode(txt, l->len, &cp);
 
 				fprintf(stderr, "cp=%d\n", cp);
 				for(int i = 0; i < l->len; i++) {
 					if(!(i % 10)) fprintf(stderr, "\n");
-					fprintf(stderr, " 0x%0x", l->buf[i]);
+					fprintf(stderr, " 0x%0x", txt[i]);
 				}
 				fprintf(stderr, "\n=== END LINE ===");
 			}
+			else if(ev.key == 'M') {
+				Buffer *b = vcur->buf;
+
+				fprintf(stderr, "%zu lines, %zu bytes mapped\n", b->lines_tot, b->map_size);
+				arena_stats(&b->arena, stderr);
+				fprintf(stderr, "undo: %zu of %zu bytes\n", b->undo.size, b->undo.max);
+				index_stop(b);
+				fprintf(stderr, "index: %u blocks, %u stale, %zu bytes\n",
+					b->index.nblocks, b->index.stale, b->index.bytes);
+			}
 			else if(ev.key == 'j') view_cursor_down(vcur);
 			else if(ev.key == 'h') view_cursor_left(vcur);
 			else if(ev.key == 'l') view_cursor_right(vcur);
 			else if(ev.key == 'q') running = 0;
+			else if(ev.key == 'S') buffer_save(vcur->buf);
+			else if(ev.key == '/') {
+				searching = 1;
+				search_line = vcur->line_idx;
+				search_col = vcur->col_idx;
+				search_set(vcur->buf, "", 0);
+				buffer_damage(vcur->buf, 0, INT_MAX);
+			} else if(ev.key == 'n') {
+				if(!search_next(vcur->buf, &vcur->line_idx, &vcur->col_idx))
+					set_msg("not found");
+			}
+			else if(ev.key == 'u') {
+				if(buffer_undo(vcur->buf, &vcur->line_idx, &vcur->col_idx))
+					view_cursor_fix(vcur);
+				else
+					set_msg("already at oldest change");
+			} else if(ev.key == CTRL('r')) {
+				if(buffer_redo(vcur->buf, &vcur->line_idx, &vcur->col_idx))
+					view_cursor_fix(vcur);
+				else
+					set_msg("already at newest change");
+			}
+			else if(ev.key == 'W') {
+				vcur->wrap = !vcur->wrap;
+				vcur->row_sub = vcur->col_off = 0;
+				vcur->redraw = 1;
+			}
 			else if(ev.key == 'D') {
 				buffer_delete_line(vcur->buf, vcur->line_idx, 1);
 				view_cursor_fix(vcur);
 			} else if(ev.key == 'K') {
-				Line *l = line_create(NULL);
+				Line *l = line_create(&vcur->buf->arena, NULL, 0);
 				buffer_insert_line(vcur->buf, vcur->line_idx, l);
 
 				/* we should call view_cursor_hfix() here since we're moving into
@@ -533,40 +3883,77 @@ run(void) {
 				vcur->col_idx = 0;
 			}
 			else if(ev.key == 'J' || ev.key == '\n') {
-				Line *l = line_create(NULL);
+				Line *l = line_create(&vcur->buf->arena, NULL, 0);
 				buffer_insert_line(vcur->buf, vcur->line_idx + 1, l);
 				view_cursor_down(vcur);
 			} else {
 				/* TODO: view_insert_text()? */
-				line_insert_text(vcur->buf->lines[vcur->line_idx], vcur->col_idx, (char *)&ev.key, 1);
+				buffer_insert_text(vcur->buf, vcur->line_idx, vcur->col_idx, (char *)&ev.key, 1);
 				vcur->col_idx += 1;
 			}
 			break;
+		case EV_PASTE:
+			buffer_insert_data(vcur->buf, &vcur->line_idx, &vcur->col_idx, ev.text, ev.len);
+			break;
+		case EV_WAKE:
 		case EV_UKN:
 			break;
 		}
-		draw_view(vcur);
+		if(ev.type == EV_KEY || ev.type == EV_PASTE)
+			lat_event(t);
+		if(lat_dump) {
+			lat_dump = 0;
+			lat_report();
+		}
+
+		/* handle all the pending input before rendering a frame */
+		if(running && ui->pending() && now_msec() - drawn < FRAME_MSEC)
+			continue;
+		for(i = 0; i < nviews; i++) {
+			buffer_poll(views[i]->buf);
+			search_poll(views[i]->buf);
+			index_poll(views[i]->buf);
+		}
+		draw_views(views, nviews);
+		drawn = now_msec();
 	}
 }
 
 int
 main(int argc, char *argv[]) {
-	char *fn = NULL;
+	char *fn = NULL, *s;
 
 	if(argc > 2) die("Usage: %s [file]", argv[0]);
 	if(argc == 2) fn = argv[1];
 
+	utf8_init();
 	ui = &ui_tui; /* the one and only... */
 	atexit(ui->exit);
 	ui->init();
+	if((lat_file = getenv("EDO_LATENCY")))
+		signal(SIGUSR1, lat_signal);
+	if((s = getenv("EDO_UNDO_MAX")))
+		undo_max = strtoull(s, NULL, 10);
+	if((s = getenv("EDO_INDEX")))
+		index_on = atoi(s);
 	Buffer *b = buffer_create(fn);
 	View *v = view_create(b);
+	buffer_destroy(b); /* the view holds it */
 	vcur = v; /* current view */
-	draw_view(v);
+	frames = frame_create(v);
+	layout();
+	draw_views(views, nviews);
 	run();
-	buffer_destroy(v->buf);
-	view_destroy(v);
+	if(lat_file)
+		lat_report();
+	frame_free(frames);
 	ui->exit();
 	free(ui->pool.data);
+	free(views);
+	free(row_cells);
+	free(layout_idx);
+	free(layout_col);
+	free(attrs);
+	free(hl_text);
 	return 0;
 }
@@ -0,0 +1,59 @@
+#include "hist.h"
+
+/* function declarations */
+int hist_bucket(uint64_t v);
+uint64_t hist_value(int b);
+
+/* function implementations */
+int
+hist_bucket(uint64_t v) {
+	int shift;
+
+	if(v < HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_BITS;
+	return shift * HIST_SUB + (v >> shift);
+}
+
+/* highest value falling in bucket b */
+uint64_t
+hist_value(int b) {
+	int shift = b / HIST_SUB - 1;
+
+	if(shift < 0)
+		return b;
+	return (((uint64_t)(b % HIST_SUB + HIST_SUB) + 1) << shift) - 1;
+}
+
+void
+hist_add(Hist *h, uint64_t v) {
+	++h->buckets[hist_bucket(v)];
+	++h->count;
+	if(v > h->max)
+		h->max = v;
+}
+
+uint64_t
+hist_pct(Hist *h, double pct) {
+	uint64_t seen = 0, want;
+	double rank = h->count * pct / 100.0;
+	int b;
+
+	if(!h->count)
+		return 0;
+	want = rank;
+	if(want < rank || !want)
+		++want;
+	for(b = 0; b < HIST_BUCKETS; b++)
+		if((seen += h->buckets[b]) >= want)
+			break;
+	return hist_value(b) < h->max ? hist_value(b) : h->max;
+}
+
+/* one line: name count p50 p99 max, values divided by scale */
+void
+hist_print(Hist *h, FILE *fp, double scale) {
+	fprintf(fp, "%-10s %8llu %10.1f %10.1f %10.1f\n", h->name,
+		(unsigned long long)h->count, hist_pct(h, 50) / scale,
+		hist_pct(h, 99) / scale, h->max / scale);
+}
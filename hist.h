@@ -0,0 +1,25 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Log-linear histogram in the HDR style: values below HIST_SUB are exact,
+ * above that every power of two is split in HIST_SUB buckets, so any
+ * recorded value is off by less than 1/HIST_SUB. */
+#define HIST_BITS	5
+#define HIST_SUB	(1 << HIST_BITS)
+#define HIST_BUCKETS	((64 - HIST_BITS + 1) * HIST_SUB)
+
+typedef struct {
+	const char *name;
+	uint64_t count;
+	uint64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+} Hist;
+
+void hist_add(Hist *h, uint64_t v);
+uint64_t hist_pct(Hist *h, double pct);
+void hist_print(Hist *h, FILE *fp, double scale);
+
+#endif
@@ -0,0 +1,81 @@
+/* Generates width.h, the two-level codepoint property table used by
+ * utf8_prop(). Run at build time so that widths come from utf8proc and
+ * not from the locale tables of the host libc. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utf8proc.h>
+
+#include "utf8.h"
+
+#define NBLOCKS (0x110000 >> 8)
+
+unsigned char blocks[NBLOCKS][256];
+unsigned short index_[NBLOCKS];
+
+/* function declarations */
+unsigned char prop(unsigned int cp);
+
+/* function implementations */
+unsigned char
+prop(unsigned int cp) {
+	utf8proc_category_t cat = utf8proc_category(cp);
+	unsigned char p;
+	int w;
+
+	/* like wcwidth(): -1 for controls, surrogates and unassigned */
+	if(cat == UTF8PROC_CATEGORY_CC || cat == UTF8PROC_CATEGORY_CS
+	|| cat == UTF8PROC_CATEGORY_CN)
+		w = -1;
+	else
+		w = utf8proc_charwidth(cp);
+	p = w + 1;
+
+	if(cat == UTF8PROC_CATEGORY_MN || cat == UTF8PROC_CATEGORY_ME)
+		p |= UTF8_COMBINING;
+	if(IS_CMOD(cp))
+		p |= UTF8_CMOD;
+	if(IS_RIS(cp))
+		p |= UTF8_RIS;
+	if(IS_VAR(cp))
+		p |= UTF8_VAR;
+
+	/* emoji which become 2 cells wide when followed by VS16 */
+	if((cp >= 0x203C && cp <= 0x3299) || cp >= 0x1F000)
+		p |= UTF8_VS16W;
+	return p;
+}
+
+int
+main(void) {
+	unsigned int cp;
+	int b, i, n = 0;
+
+	for(b = 0; b < NBLOCKS; b++) {
+		for(cp = 0; cp < 256; cp++)
+			blocks[n][cp] = prop(b << 8 | cp);
+
+		/* share identical blocks */
+		for(i = 0; i < n; i++)
+			if(!memcmp(blocks[i], blocks[n], 256))
+				break;
+		index_[b] = i;
+		if(i == n)
+			++n;
+	}
+
+	printf("/* generated by mkwidth, do not edit */\n\n");
+	printf("const unsigned short utf8_prop_index[%d] = {", NBLOCKS);
+	for(b = 0; b < NBLOCKS; b++)
+		printf("%s%d,", b % 16 ? " " : "\n\t", index_[b]);
+	printf("\n};\n\n");
+	printf("const unsigned char utf8_prop_blocks[%d][256] = {\n", n);
+	for(i = 0; i < n; i++) {
+		printf("\t{");
+		for(cp = 0; cp < 256; cp++)
+			printf("%s%d,", cp % 16 ? " " : "\n\t\t", blocks[i][cp]);
+		printf("\n\t},\n");
+	}
+	printf("};\n");
+	return 0;
+}
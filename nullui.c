@@ -0,0 +1,191 @@
+/* headless backend: keeps the screen in memory, used by the benchmarks */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ui.h"
+
+#define CURPOS "\x1b[%d;%dH"
+
+/* globals */
+Cell *null_screen; /* null_rows x null_cols */
+int *null_count; /* cells drawn per row */
+int null_rows = 24, null_cols = 80;
+int null_x, null_y;
+int null_capture; /* keep the frame bytes in null_frame */
+char *null_frame;
+size_t null_frame_len, null_frame_cap;
+char *null_keys; /* fed to next_event() one byte at a time */
+
+extern void *ecalloc(size_t nmemb, size_t size);
+extern void *erealloc(void *p, size_t size);
+extern char *cell_get_text(Cell *cell, char *pool_base);
+extern int tui_text_width(char *s, int len, int x);
+extern int tui_text_len(char *s, int len);
+extern int tui_text_run(char *s, int len);
+
+/* function declarations */
+void null_resize(int r, int c);
+void null_emit(const char *s, size_t len);
+void null_init(void);
+void null_exit(void);
+void null_frame_start(void);
+void null_frame_flush(void);
+void null_move_cursor(int x, int y);
+void null_draw_line(UI *ui, int x, int y, Cell *cells, int count);
+void null_draw_symbol(int c, int r, Symbol sym);
+void null_scroll(int top, int bottom, int n);
+void null_get_window_size(int *rows, int *cols);
+Event null_next_event(void);
+int null_pending(void);
+void null_wakeup(void);
+
+/* function implementations */
+void
+null_resize(int r, int c) {
+	free(null_screen);
+	free(null_count);
+	null_rows = r;
+	null_cols = c;
+	null_screen = ecalloc(r * c, sizeof(Cell));
+	null_count = ecalloc(r, sizeof(int));
+}
+
+void
+null_emit(const char *s, size_t len) {
+	if(null_frame_len + len > null_frame_cap) {
+		null_frame_cap = (null_frame_len + len) * 2;
+		null_frame = erealloc(null_frame, null_frame_cap);
+	}
+	memcpy(null_frame + null_frame_len, s, len);
+	null_frame_len += len;
+}
+
+void
+null_init(void) {
+	if(!null_screen)
+		null_resize(null_rows, null_cols);
+}
+
+void
+null_exit(void) {
+	free(null_screen);
+	free(null_count);
+	free(null_frame);
+	null_screen = NULL;
+	null_count = NULL;
+	null_frame = NULL;
+	null_frame_len = null_frame_cap = 0;
+}
+
+void
+null_frame_start(void) {
+	null_frame_len = 0;
+}
+
+void
+null_frame_flush(void) {
+	char pos[32];
+
+	if(null_capture)
+		null_emit(pos, snprintf(pos, sizeof pos, CURPOS, null_y + 1, null_x + 1));
+	ui_null.written += null_frame_len;
+}
+
+void
+null_move_cursor(int x, int y) {
+	null_x = x;
+	null_y = y;
+}
+
+void
+null_draw_line(UI *ui, int x, int y, Cell *cells, int count) {
+	char pos[32];
+	int i;
+
+	if(y < 0 || y >= null_rows)
+		return;
+	if(count > null_cols - x)
+		count = null_cols - x;
+	memcpy(null_screen + y * null_cols + x, cells, count * sizeof(Cell));
+	null_count[y] = x + count;
+	if(!null_capture)
+		return;
+	null_emit(pos, snprintf(pos, sizeof pos, CURPOS, y + 1, x + 1));
+	for(i = 0; i < count; i++)
+		null_emit(cell_get_text(&cells[i], ui->pool.data), cells[i].len);
+}
+
+void
+null_draw_symbol(int c, int r, Symbol sym) {
+	Cell cell;
+
+	memset(&cell, 0, sizeof(Cell));
+	cell.data.text[0] = sym == SYM_EMPTYLINE ? '~' : '?';
+	cell.len = cell.width = 1;
+	null_draw_line(&ui_null, c, r, &cell, 1);
+}
+
+void
+null_scroll(int top, int bottom, int n) {
+	int y, from;
+
+	for(y = n > 0 ? top : bottom - 1; y >= top && y < bottom; y += n > 0 ? 1 : -1) {
+		from = y + n;
+		if(from >= top && from < bottom) {
+			memcpy(null_screen + y * null_cols, null_screen + from * null_cols,
+				null_cols * sizeof(Cell));
+			null_count[y] = null_count[from];
+		} else {
+			null_count[y] = 0;
+		}
+	}
+}
+
+void
+null_get_window_size(int *rows, int *cols) {
+	*rows = null_rows;
+	*cols = null_cols;
+}
+
+Event
+null_next_event(void) {
+	Event ev;
+
+	memset(&ev, 0, sizeof(Event));
+	if(!null_keys || !*null_keys) {
+		ev.type = EV_UKN;
+		return ev;
+	}
+	ev.type = EV_KEY;
+	ev.key = *null_keys++;
+	return ev;
+}
+
+int
+null_pending(void) {
+	return null_keys && *null_keys;
+}
+
+void
+null_wakeup(void) {
+}
+
+UI ui_null = {
+	.name = "null",
+	.init = null_init,
+	.exit = null_exit,
+	.frame_start = null_frame_start,
+	.frame_flush = null_frame_flush,
+	.text_width = tui_text_width,
+	.text_len = tui_text_len,
+	.text_run = tui_text_run,
+	.move_cursor = null_move_cursor,
+	.draw_line = null_draw_line,
+	.draw_symbol = null_draw_symbol,
+	.scroll = null_scroll,
+	.get_window_size = null_get_window_size,
+	.next_event = null_next_event,
+	.pending = null_pending,
+	.wakeup = null_wakeup
+};
@@ -1,8 +1,7 @@
-#define _XOPEN_SOURCE
 #define _BSD_SOURCE
-#include <wchar.h>
 
 #include <assert.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <poll.h>
 #include <stdarg.h>
@@ -18,9 +17,22 @@
 
 #define ESC             "\x1b"
 #define CURPOS          ESC"[%d;%dH"
-#define CLEARRIGHT      ESC"[0K"
+#define CLEARRIGHT      ESC"[K"
+#define SGRRESET        ESC"[m"
+#define SCROLLREGION    ESC"[%d;%dr"
+#define SCROLLRESET     ESC"[r"
+#define REVINDEX        ESC"M"
+#define SGRHEX          ESC"[48;5;233m"
+#define SGRMATCH        ESC"[7m"
 #define CURHIDE         ESC"[?25l"
 #define CURSHOW         ESC"[?25h"
+#define PASTEON         ESC"[?2004h"
+#define PASTEOFF        ESC"[?2004l"
+#define PASTESTART      "[200~"
+#define PASTEEND        "[201~"
+#define ESCWAIT         25 /* msec to wait for the rest of a sequence */
+
+#define INBUF_SIZE      4096 /* power of two */
 //#define CLEARLEFT       ESC"[1K"
 //#define ERASECHAR       ESC"[1X"
 
@@ -30,10 +42,31 @@ typedef struct {
 	int cap;
 } Abuf;
 
+/* what is currently on screen for a row, cells longer than
+ * CELL_POOL_THRESHOLD keep a hash of their text in pool_idx */
+typedef struct {
+	Cell *cells;
+	int count;
+	int cap;
+	int width; /* -1 if unknown */
+} Row;
+
 /* globals */
 struct termios origti;
 struct winsize ws;
 Abuf frame;
+Abuf paste;
+Row *rows;
+Cell *shadow; /* cells of all rows */
+char inbuf[INBUF_SIZE];
+unsigned int in_head, in_tail; /* free running, read at head */
+int wake_pipe[2] = {-1, -1};
+int tui_out = STDOUT_FILENO; /* where frames go */
+int frame_dirty;
+int cur_x = -1, cur_y = -1; /* -1 if unknown */
+int sgr_cur = -1; /* attributes in effect, -1 if unknown */
+int sgr_text; /* attributes of the cell being drawn */
+int want_x, want_y;
 int compat_mode;
 int is_modern;
 int vs16_double = 1;
@@ -44,6 +77,24 @@ extern void *erealloc(void *p, size_t size);
 extern void die(const char *fmt, ...);
 extern char *cell_get_text(Cell *cell, char *pool_base);
 
+/* attributes */
+enum {
+	SGR_NONE,
+	SGR_HEX,
+	SGR_MATCH,
+	SGR_ATTR /* plus the cell attribute - 1 */
+};
+
+/* foreground of each cell attribute */
+const char *sgr_attr[] = {
+	[ATTR_KEYWORD] = ESC"[33m",
+	[ATTR_TYPE] = ESC"[32m",
+	[ATTR_STRING] = ESC"[35m",
+	[ATTR_NUMBER] = ESC"[31m",
+	[ATTR_COMMENT] = ESC"[34m",
+	[ATTR_PREPROC] = ESC"[36m"
+};
+
 /* function declarations */
 void ab_free(Abuf *ab);
 void ab_ensure_cap(Abuf *ab, size_t addlen);
@@ -52,14 +103,34 @@ int ab_printf(Abuf *ab, const char *fmt, ...);
 void ab_flush(Abuf *ab);
 void tui_frame_start(void);
 void tui_frame_flush(void);
+void tui_frame_begin(void);
+void tui_invalidate(void);
+void tui_sgr(int attr);
+void tui_write(const char *s, size_t len);
+void tui_resize(int r, int c);
+unsigned int text_hash(char *s, int len);
+int cell_same(Cell *scr, Cell *c, char *pool);
+void row_store(Row *r, Cell *cells, int count, int width, char *pool);
 int tui_text_width(char *s, int len, int x);
 int tui_text_len(char *s, int len);
+int tui_text_run(char *s, int len);
 void tui_get_window_size(int *rows, int *cols);
 void tui_exit(void);
 void tui_move_cursor(int x, int y);
-void tui_draw_line(UI *ui, int x, int y, Cell *cells, int screen_cols);
+void tui_place_cursor(int x, int y);
+int tui_draw_cell(UI *ui, Cell *c, int x);
+int tui_draw_cell_compat(UI *ui, Cell *c, int x);
+void tui_draw_line(UI *ui, int x, int y, Cell *cells, int count);
 void tui_draw_symbol(int r, int c, Symbol sym);
 void tui_init(void);
+int tui_fill(void);
+int tui_read_byte(void);
+int tui_peek(int i);
+int tui_match(const char *seq);
+void tui_read_paste(void);
+int tui_pending(void);
+Event tui_next_event(void);
+void tui_wakeup(void);
 
 /* function implementations */
 void
@@ -79,13 +150,13 @@ ab_ensure_cap(Abuf *ab, size_t addlen) {
 	if(newlen <= ab->cap)
 		return;
 	while(newlen > ab->cap)
-		ab->cap = ab->cap ? ab->cap * 2 : 8;
+		ab->cap = ab->cap ? ab->cap * 2 : 4096;
 	ab->buf = erealloc(ab->buf, ab->cap);
 }
 
 void
 ab_write(Abuf *ab, const char *s, size_t len) {
-	ab_ensure_cap(&frame, len);
+	ab_ensure_cap(ab, len);
 	memcpy(ab->buf + ab->len, s, len);
 	ab->len += len;
 }
@@ -112,21 +183,128 @@ ab_printf(Abuf *ab, const char *fmt, ...) {
 
 void
 ab_flush(Abuf *ab) {
-	write(STDOUT_FILENO, ab->buf, ab->len);
-	ab_free(ab);
+	if(ab->len)
+		write(tui_out, ab->buf, ab->len);
+	ab->len = 0; /* keep the memory for the next frame */
 }
 
 void
 tui_frame_start(void) {
+	frame_dirty = 0;
+}
+
+/* called before emitting anything, so that frames which only move the
+ * cursor do not need to hide it */
+void
+tui_frame_begin(void) {
+	if(frame_dirty)
+		return;
+	frame_dirty = 1;
 	ab_write(&frame, CURHIDE, sizeof CURHIDE - 1);
 }
 
 void
 tui_frame_flush(void) {
-	ab_write(&frame, CURSHOW, sizeof CURSHOW - 1);
+	if(sgr_cur != SGR_NONE && frame_dirty)
+		tui_sgr(SGR_NONE);
+	if(frame_dirty || want_x != cur_x || want_y != cur_y)
+		tui_move_cursor(want_x, want_y);
+	if(frame_dirty)
+		ab_write(&frame, CURSHOW, sizeof CURSHOW - 1);
+	ui_tui.written += frame.len;
 	ab_flush(&frame);
 }
 
+/* forget what is on screen, next frame repaints everything */
+void
+tui_invalidate(void) {
+	int y;
+
+	for(y = 0; y < ws.ws_row; y++)
+		rows[y].width = -1;
+	cur_x = cur_y = -1;
+	sgr_cur = -1;
+}
+
+/* switch attributes, only if they change */
+void
+tui_sgr(int attr) {
+	const char *fg;
+
+	if(attr == sgr_cur)
+		return;
+	/* one foreground replaces another */
+	if(attr == SGR_NONE || (sgr_cur != SGR_NONE && (attr < SGR_ATTR || sgr_cur < SGR_ATTR)))
+		ab_write(&frame, SGRRESET, sizeof SGRRESET - 1);
+	if(attr == SGR_HEX) {
+		ab_write(&frame, SGRHEX, sizeof SGRHEX - 1);
+	} else if(attr == SGR_MATCH) {
+		ab_write(&frame, SGRMATCH, sizeof SGRMATCH - 1);
+	} else if(attr >= SGR_ATTR) {
+		fg = sgr_attr[attr - SGR_ATTR + 1];
+		ab_write(&frame, fg, strlen(fg));
+	}
+	sgr_cur = attr;
+}
+
+/* text with the attributes of its cell */
+void
+tui_write(const char *s, size_t len) {
+	tui_sgr(sgr_text);
+	ab_write(&frame, s, len);
+}
+
+/* forget the screen and start over with a r x c one */
+void
+tui_resize(int r, int c) {
+	int y;
+
+	free(rows);
+	free(shadow);
+	ws.ws_row = r;
+	ws.ws_col = c;
+	rows = ecalloc(r, sizeof(Row));
+	shadow = ecalloc(r * c, sizeof(Cell));
+	for(y = 0; y < r; y++) {
+		rows[y].cells = shadow + y * c;
+		rows[y].cap = c;
+	}
+	tui_invalidate();
+}
+
+unsigned int
+text_hash(char *s, int len) {
+	unsigned int h = 2166136261u;
+
+	while(len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+int
+cell_same(Cell *scr, Cell *c, char *pool) {
+	if(scr->len != c->len || scr->width != c->width || scr->flags != c->flags
+	|| scr->attr != c->attr)
+		return 0;
+	if(c->len > CELL_POOL_THRESHOLD)
+		return scr->data.pool_idx == text_hash(pool + c->data.pool_idx, c->len);
+	return !memcmp(scr->data.text, c->data.text, c->len);
+}
+
+void
+row_store(Row *r, Cell *cells, int count, int width, char *pool) {
+	int i;
+
+	if(count > r->cap) /* cannot be on screen anyway */
+		count = r->cap;
+	memcpy(r->cells, cells, sizeof(Cell) * count);
+	for(i = 0; i < count; i++)
+		if(cells[i].len > CELL_POOL_THRESHOLD)
+			r->cells[i].data.pool_idx = text_hash(pool + cells[i].data.pool_idx, cells[i].len);
+	r->count = count;
+	r->width = width;
+}
+
 /* XXX move to utils? */
 int
 hexlen(unsigned int n) {
@@ -142,42 +320,45 @@ hexlen(unsigned int n) {
 int
 tui_text_width(char *s, int len, int x) {
 	int tabstop = 8;
-	int w = 0, i;
-	int step, wc;
+	int w, i;
+	int step, wc, p;
 	unsigned int cp;
 
-	for(i = 0; i < len; i += step) {
+	/* printable ASCII is one cell per byte */
+	w = i = utf8_ascii_run(s, len);
+	for(; i < len; i += step) {
 		step = utf8_decode(s + i, len - i, &cp);
 		if(cp == '\t') {
-			w += tabstop - x % tabstop;
+			w += tabstop - (x + w) % tabstop;
 			continue;
 		}
 
 		wc = -1;
+		p = utf8_prop(cp);
 
 		/* force RIS to be 2-cells wide */
-		if(compat_mode && IS_RIS(cp)) wc = 2;
+		if(compat_mode && (p & UTF8_RIS)) wc = 2;
 
 		/* color modifier is zero-width in modern terminals while legacy
 		 * VTs are able to see the square color modifiers */
-		if(is_modern && IS_CMOD(cp)) wc = 0;
+		if(is_modern && (p & UTF8_CMOD)) wc = 0;
 
 		/* force 2 cells width for emoji followed by VS16 */
-		if(vs16_double && is_modern && wc == -1) {
+		if(vs16_double && is_modern && wc == -1 && (p & UTF8_VS16W)) {
 			int nxi = i + step;
 			if(nxi < len) {
 				unsigned int nxcp;
 				utf8_decode(s + nxi, len - nxi, &nxcp);
-				if(nxcp == 0xFE0F && ((cp >= 0x203C && cp <= 0x3299) || cp >= 0x1F000))
+				if(nxcp == 0xFE0F)
 					wc = 2;
 			}
 		}
 
-		if(wc < 0) wc = wcwidth(cp);
+		if(wc < 0) wc = UTF8_WIDTH(p);
 		assert(wc != -1);
 
 		if(wc > 0) w += wc;
-		else if(compat_mode && !utf8_is_combining(cp)) w += hexlen(cp) + 2; /* 2 for < and > */
+		else if(compat_mode && !(p & UTF8_COMBINING)) w += hexlen(cp) + 2; /* 2 for < and > */
 		//else w += hexlen(cp) + 2; /* 2 for < and > */
 	}
 	return w;
@@ -185,9 +366,23 @@ tui_text_width(char *s, int len, int x) {
 
 int
 tui_text_len(char *s, int len) {
+	/* printable ASCII followed by ASCII is always a cluster on its own */
+	if(len && s[0] >= 0x20 && s[0] < 0x7f && (len == 1 || !(s[1] & 0x80)))
+		return 1;
 	return compat_mode ? utf8_len_compat(s, len) : utf8_len(s, len);
 }
 
+/* leading bytes which are one-byte one-cell clusters, the last ASCII
+ * byte may start a cluster with the non-ASCII bytes following it */
+int
+tui_text_run(char *s, int len) {
+	int n = utf8_ascii_run(s, len);
+
+	if(n && n < len && (s[n] & 0x80))
+		--n;
+	return n;
+}
+
 void
 tui_get_window_size(int *rows, int *cols) {
 	*rows = ws.ws_row;
@@ -197,168 +392,301 @@ tui_get_window_size(int *rows, int *cols) {
 void
 tui_exit(void) {
 	tcsetattr(0, TCSANOW, &origti);
-	printf(CURPOS CLEARRIGHT, ws.ws_row, 0);
+	printf(PASTEOFF CURPOS CLEARRIGHT, ws.ws_row, 0);
+	ab_free(&paste);
+	ab_free(&frame);
+	if(wake_pipe[0] != -1) {
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		wake_pipe[0] = wake_pipe[1] = -1;
+	}
+	free(rows);
+	free(shadow);
+	rows = NULL;
+	shadow = NULL;
 }
 
 void
 tui_move_cursor(int c, int r) {
-	int x = c + 1, y = r + 1; /* TERM coords are 1-based */
-	ab_printf(&frame, CURPOS, y, x);
-}
-
-void
-tui_draw_line_compat(UI *ui, int x, int y, Cell *cells, int count) {
-	char *txt;
-	int i;
-
-	tui_move_cursor(x, y);
-	for(i = 0; i < count; i++) {
-		txt = cell_get_text(cells + i, ui->pool.data);
-
-		int w = 0;
-		int o = 0;
+	char abs[32], rel[32];
+	int n, k, dy;
 
-		while(o < cells[i].len && w < cells[i].width) {
-			unsigned int cp;
-			int step = utf8_decode(txt + o, cells[i].len - o, &cp);
+	if(c == cur_x && r == cur_y)
+		return;
 
-			if(cp == '\t') {
-				while(w++ < cells[i].width)
-					ab_write(&frame, " ", 1);
-				break;
+	/* TERM coords are 1-based */
+	if(!c)
+		n = snprintf(abs, sizeof abs, r ? ESC"[%dH" : ESC"[H", r + 1);
+	else
+		n = snprintf(abs, sizeof abs, CURPOS, r + 1, c + 1);
+
+	/* a relative move is often shorter, it needs a known row */
+	k = 0;
+	if(cur_y >= 0) {
+		dy = r - cur_y;
+		if(dy > 0 && dy <= 2)
+			while(dy--) rel[k++] = '\n'; /* raw mode, no CR */
+		else if(dy > 0)
+			k += snprintf(rel + k, sizeof rel - k, ESC"[%dB", dy);
+		else if(dy < 0)
+			k += snprintf(rel + k, sizeof rel - k, dy == -1 ? ESC"[A" : ESC"[%dA", -dy);
+		if(c != cur_x) {
+			if(!c || cur_x < 0) {
+				rel[k++] = '\r';
+				cur_x = 0;
 			}
+			if(c > cur_x)
+				k += snprintf(rel + k, sizeof rel - k, c - cur_x == 1 ? ESC"[C" : ESC"[%dC", c - cur_x);
+			else if(c < cur_x && cur_x - c <= 3)
+				while(cur_x-- > c) rel[k++] = '\b';
+			else if(c < cur_x)
+				k += snprintf(rel + k, sizeof rel - k, ESC"[%dD", cur_x - c);
+		}
+	}
+	if(cur_y >= 0 && k < n)
+		ab_write(&frame, rel, k);
+	else
+		ab_write(&frame, abs, n);
+	cur_x = c;
+	cur_y = r;
+}
 
-			int cw = wcwidth(cp);
-			if(cw < 0) break;
-
-			int showhex = !cw && !IS_CMOD(cp) && !IS_VAR(cp) && !utf8_is_combining(cp) ? 1 : 0;
+/* the cursor is moved where asked at the end of the frame */
+void
+tui_place_cursor(int c, int r) {
+	want_x = c;
+	want_y = r;
+}
 
-			if(!showhex && is_modern && compat_mode && IS_CMOD(cp)) showhex = 1;
+int
+tui_draw_cell_compat(UI *ui, Cell *c, int x) {
+	char *txt = cell_get_text(c, ui->pool.data);
+	int w = 0;
+	int o = 0;
 
-			if(showhex) {
-				char tag[16];
-				snprintf(tag, sizeof tag, "<%0x>", cp);
+	while(o < c->len && w < c->width) {
+		unsigned int cp;
+		int step = utf8_decode(txt + o, c->len - o, &cp);
 
-				if(cells[i].flags & CELL_TRUNC_L) {
-					cw = tui_text_width(txt + o, cells[i].len - o, 0);
-					o = cw - cells[i].width;
-					if(o < 0) o = 0;
-				}
-				{ const char t[] = ESC"[48;5;233m"; ab_write(&frame, t, sizeof t - 1); }
+		if(cp == '\t') {
+			while(w++ < c->width)
+				tui_write(" ", 1);
+			break;
+		}
 
-				int j = 0;
+		int p = utf8_prop(cp);
+		int cw = UTF8_WIDTH(p);
+		if(cw < 0) break;
 
-				while(w < cells[i].width && x+w < ws.ws_col) {
-					ab_write(&frame, tag + o + j++, 1);
-					++w;
-				}
+		int showhex = !cw && !(p & (UTF8_CMOD | UTF8_VAR | UTF8_COMBINING)) ? 1 : 0;
 
-				{ const char t[] = ESC"[0m"; ab_write(&frame, t, sizeof t - 1); }
-				break;
-			}
+		if(!showhex && is_modern && compat_mode && (p & UTF8_CMOD)) showhex = 1;
 
-			/* to preserve coherence between terminals always split
-			 * RIS so that we can see individual components. */
-			if(is_modern && IS_RIS(cp))
-				ab_write(&frame, ZWNJ, sizeof ZWNJ - 1);
+		if(showhex) {
+			char tag[16];
+			snprintf(tag, sizeof tag, "<%0x>", cp);
 
-			if(!cw) {
-				ab_write(&frame, txt + o, step);
-				o += step;
-				continue;
+			if(c->flags & CELL_TRUNC_L) {
+				cw = tui_text_width(txt + o, c->len - o, 0);
+				o = cw - c->width;
+				if(o < 0) o = 0;
 			}
+			tui_sgr(SGR_HEX);
 
+			int j = 0;
 
-			if(cells[i].flags & CELL_TRUNC_L) {
-				ab_write(&frame, "<", 1);
-				++w;
-				while(w++ < cells[i].width) ab_write(&frame, ".", 1);
-				break;
-			}
-			if(cells[i].flags & CELL_TRUNC_R) {
-				ab_write(&frame, ">", 1);
+			while(w < c->width && x+w < ws.ws_col) {
+				ab_write(&frame, tag + o + j++, 1);
 				++w;
-				while(w++ < cells[i].width) ab_write(&frame, ".", 1);
-				break;
 			}
+			break;
+		}
 
-			if(x+cw > ws.ws_col) break;
-			ab_write(&frame, txt + o, step);
+		/* to preserve coherence between terminals always split
+		 * RIS so that we can see individual components. */
+		if(is_modern && (p & UTF8_RIS))
+			tui_write(ZWNJ, sizeof ZWNJ - 1);
 
+		if(!cw) {
+			tui_write(txt + o, step);
 			o += step;
-			w += cw;
+			continue;
 		}
-		//ab_write(&frame, txt, cells[i].len);
 
-		/* pad to ensure we always honor cells[i].width
-		 * should only happens with RIS on legacy VTs */
-		if(!is_modern && w < cells[i].width) {
-			while(w < cells[i].width && x+w < ws.ws_col) {
-				ab_write(&frame, " ", 1);
-				++w;
-			}
+
+		if(c->flags & CELL_TRUNC_L) {
+			tui_write("<", 1);
+			++w;
+			while(w++ < c->width) tui_write(".", 1);
+			break;
+		}
+		if(c->flags & CELL_TRUNC_R) {
+			tui_write(">", 1);
+			++w;
+			while(w++ < c->width) tui_write(".", 1);
+			break;
 		}
 
-		x += w;
+		if(x+cw > ws.ws_col) break;
+		tui_write(txt + o, step);
+
+		o += step;
+		w += cw;
 	}
 
-	if(x < ws.ws_col) ab_write(&frame, CLEARRIGHT, strlen(CLEARRIGHT));
+	/* pad to ensure we always honor c->width
+	 * should only happens with RIS on legacy VTs */
+	if(!is_modern && w < c->width) {
+		while(w < c->width && x+w < ws.ws_col) {
+			tui_write(" ", 1);
+			++w;
+		}
+	}
+	return w;
 }
 
-void
-tui_draw_line(UI *ui, int x, int y, Cell *cells, int count) {
-	assert(x < ws.ws_col && y < ws.ws_row);
+int
+tui_draw_cell(UI *ui, Cell *c, int x) {
+	char *txt;
+	int j;
 
-	if(compat_mode) {
-		tui_draw_line_compat(ui, x, y, cells, count);
-		return;
+	if(compat_mode)
+		return tui_draw_cell_compat(ui, c, x);
+
+	txt = cell_get_text(c, ui->pool.data);
+
+	/* TODO: temp code for testing, we'll se how to deal with this later */
+	if(txt[0] == '\t') {
+		for(j = 0; j < c->width; j++)
+			tui_write(" ", 1);
+		return c->width;
 	}
 
-	char *txt;
-	int i;
+	if(c->flags & CELL_TRUNC_L) {
+		tui_write("<", 1);
+		for(j = 1; j < c->width; ++j)
+			tui_write(".", 1);
+		return c->width;
+	}
+	if(c->flags & CELL_TRUNC_R) {
+		tui_write(">", 1);
+		for(j = 1; j < c->width; ++j)
+			tui_write(".", 1);
+		return c->width;
+	}
 
-	tui_move_cursor(x, y);
-	for(i = 0; i < count; i++) {
-		x += cells[i].width;
-		txt = cell_get_text(cells + i, ui->pool.data);
+	tui_write(txt, c->len);
+	return c->width;
+}
 
-		/* TODO: temp code for testing, we'll se how to deal with this later */
-		if(txt[0] == '\t') {
-			for(int t = 0; t < cells[i].width; t++)
-				ab_write(&frame, " ", 1);
-			continue;
-		}
+/* only emit the cells which differ from what is already on screen */
+void
+tui_draw_line(UI *ui, int x, int y, Cell *cells, int count) {
+	Row *r = &rows[y];
+	int i, j, k, width = 0, start, exact;
 
-		if(cells[i].flags & CELL_TRUNC_L) {
-			ab_write(&frame, "<", 1);
-			for(int j = 1; j < cells[i].width; ++j)
-				ab_write(&frame, ".", 1);
-			continue;
+	assert(x < ws.ws_col && y < ws.ws_row);
+
+	for(i = 0; i < count; i++)
+		width += cells[i].width;
+
+	i = 0;
+	j = count;
+	if(r->width != -1) {
+		/* skip the unchanged head and, if the row keeps its width,
+		 * the unchanged tail */
+		while(i < count && i < r->count && cell_same(&r->cells[i], &cells[i], ui->pool.data))
+			++i;
+		if(width == r->width) {
+			for(k = 1; count - k >= i && r->count - k >= i; k++)
+				if(!cell_same(&r->cells[r->count - k], &cells[count - k], ui->pool.data))
+					break;
+			j = count - k + 1;
 		}
-		if(cells[i].flags & CELL_TRUNC_R) {
-			ab_write(&frame, ">", 1);
-			for(int j = 1; j < cells[i].width; ++j)
-				ab_write(&frame, ".", 1);
-			continue;
+		if(i == j && width == r->width) {
+			row_store(r, cells, count, width, ui->pool.data);
+			return;
 		}
-
-		ab_write(&frame, txt, cells[i].len);
 	}
 
-	ab_write(&frame, CLEARRIGHT, strlen(CLEARRIGHT));
+	tui_frame_begin();
+	for(start = x, k = 0; k < i; k++)
+		start += cells[k].width;
+	tui_move_cursor(start, y);
+	x = start;
+	for(exact = 1, k = i; k < j; k++) {
+		if(cells[k].flags & CELL_MATCH)
+			sgr_text = SGR_MATCH;
+		else
+			sgr_text = cells[k].attr ? SGR_ATTR + cells[k].attr - 1 : SGR_NONE;
+		x += tui_draw_cell(ui, &cells[k], x);
+		if(cells[k].len != 1 || cells[k].data.text[0] & 0x80)
+			exact = 0;
+	}
+	sgr_text = SGR_NONE;
+
+	/* the terminal may not agree on the width of anything but ASCII, and
+	 * at the margin the cursor waits for a wrap */
+	cur_x = exact && x < ws.ws_col ? x : -1;
+	if(j == count && x < ws.ws_col && (r->width == -1 || width < r->width)) {
+		tui_sgr(SGR_NONE); /* erase uses the background color */
+		ab_write(&frame, CLEARRIGHT, sizeof CLEARRIGHT - 1);
+	}
+	row_store(r, cells, count, width, ui->pool.data);
 }
 
 void
 tui_draw_symbol(int c, int r, Symbol sym) {
-	int symch;
+	Cell cell;
 
+	memset(&cell, 0, sizeof(Cell));
 	switch(sym) {
-	case SYM_EMPTYLINE: symch = '~'; break;
-	default: symch = '?'; break;
+	case SYM_EMPTYLINE: cell.data.text[0] = '~'; break;
+	default: cell.data.text[0] = '?'; break;
 	}
+	cell.len = cell.width = 1;
+	tui_draw_line(&ui_tui, c, r, &cell, 1);
+}
 
-	tui_move_cursor(c, r);
-	ab_printf(&frame, "%c" CLEARRIGHT, symch);
+/* Scroll rows top to bottom - 1 within a scroll region, LF at the bottom
+ * margin moves them up and RI at the top margin moves them down. The shadow
+ * rows follow, the exposed ones are known to be blank. */
+void
+tui_scroll(int top, int bottom, int n) {
+	Row tmp;
+	int y, k;
+
+	if(!n)
+		return;
+	tui_frame_begin();
+	tui_sgr(SGR_NONE); /* new rows get the current background */
+	ab_printf(&frame, SCROLLREGION, top + 1, bottom);
+	cur_x = cur_y = 0; /* DECSTBM homes the cursor */
+	tui_move_cursor(0, n > 0 ? bottom - 1 : top);
+	for(k = n > 0 ? n : -n; k; k--) {
+		if(n > 0)
+			ab_write(&frame, "\n", 1);
+		else
+			ab_write(&frame, REVINDEX, sizeof REVINDEX - 1);
+	}
+	ab_write(&frame, SCROLLRESET, sizeof SCROLLRESET - 1);
+	cur_x = cur_y = 0;
+
+	/* rotate the shadow, the cells stay with their Row */
+	for(k = n > 0 ? n : -n; k; k--) {
+		if(n > 0) {
+			tmp = rows[top];
+			memmove(&rows[top], &rows[top + 1], (bottom - top - 1) * sizeof(Row));
+			y = bottom - 1;
+		} else {
+			tmp = rows[bottom - 1];
+			memmove(&rows[top + 1], &rows[top], (bottom - top - 1) * sizeof(Row));
+			y = top;
+		}
+		rows[y] = tmp;
+		rows[y].count = 0;
+		rows[y].width = 0;
+	}
 }
 
 int
@@ -425,6 +753,7 @@ tui_init(void) {
 	tcsetattr(0, TCSAFLUSH, &ti);
 	setbuf(stdout, NULL);
 	ioctl(0, TIOCGWINSZ, &ws);
+	tui_resize(ws.ws_row, ws.ws_col);
 
 	/* auto-detect VT type */
 	char user_input[1024];
@@ -438,23 +767,132 @@ tui_init(void) {
 	//die("Is%smodern VT (width=%d)\n", is_modern ? " " : " NOT ", emoji_width);
 	compat_mode = !is_modern; /* TODO: toggable (upward only) */
 	compat_mode = 1; /* currently forced for development */
+
+	write(STDOUT_FILENO, PASTEON, sizeof PASTEON - 1);
+
+	/* other threads wake up next_event() through this */
+	if(pipe(wake_pipe))
+		die("Cannot create the wakeup pipe.");
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+}
+
+/* read whatever input is available into the ring, blocks if there is
+ * none */
+int
+tui_fill(void) {
+	unsigned int at = in_tail % INBUF_SIZE;
+	unsigned int room = INBUF_SIZE - (in_tail - in_head);
+	int n;
+
+	if(room > INBUF_SIZE - at)
+		room = INBUF_SIZE - at;
+	if(!room)
+		return 0;
+	if((n = read(STDIN_FILENO, inbuf + at, room)) > 0)
+		in_tail += n;
+	return n;
 }
 
 int
 tui_read_byte(void) {
-	char c;
+	if(in_head == in_tail && tui_fill() <= 0)
+		return -1;
+	return inbuf[in_head++ % INBUF_SIZE];
+}
+
+/* byte i positions after the read head, waiting a little for it */
+int
+tui_peek(int i) {
+	struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+
+	while(in_tail - in_head <= i) {
+		if(poll(&fd, 1, ESCWAIT) <= 0 || tui_fill() <= 0)
+			return -1;
+	}
+	return inbuf[(in_head + i) % INBUF_SIZE];
+}
+
+/* consume seq if the input continues with it */
+int
+tui_match(const char *seq) {
+	int i;
 
-	if(read(STDIN_FILENO, &c, 1) == 1)
-		return c;
-	return -1;
+	for(i = 0; seq[i]; i++)
+		if(tui_peek(i) != seq[i])
+			return 0;
+	in_head += i;
+	return 1;
+}
+
+/* collect a bracketed paste up to its end marker */
+void
+tui_read_paste(void) {
+	unsigned int at, n;
+	char *esc;
+
+	paste.len = 0;
+	while(1) {
+		if(in_head == in_tail && tui_fill() <= 0)
+			break;
+		at = in_head % INBUF_SIZE;
+		n = in_tail - in_head;
+		if(n > INBUF_SIZE - at)
+			n = INBUF_SIZE - at;
+		if((esc = memchr(inbuf + at, 0x1B, n)))
+			n = esc - (inbuf + at);
+		ab_write(&paste, inbuf + at, n);
+		in_head += n;
+		if(!esc)
+			continue;
+		++in_head;
+		if(tui_match(PASTEEND))
+			break;
+		ab_write(&paste, "\x1b", 1);
+	}
+}
+
+int
+tui_pending(void) {
+	struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+
+	return in_head != in_tail || poll(&fd, 1, 0) > 0;
 }
 
 Event
 tui_next_event(void) {
+	struct pollfd fds[2] = {
+		{STDIN_FILENO, POLLIN, 0},
+		{wake_pipe[0], POLLIN, 0}
+	};
+	char drain[64];
 	Event ev;
-	int c = tui_read_byte();
+	int c;
+
+	if(in_head == in_tail) {
+		while(poll(fds, 2, -1) <= 0);
+		if(fds[1].revents & POLLIN) {
+			while(read(wake_pipe[0], drain, sizeof drain) > 0);
+			ev.type = EV_WAKE;
+			return ev;
+		}
+	}
+	c = tui_read_byte();
 
 	if(c == 0x1B) {
+		if(tui_match(PASTESTART)) {
+			tui_read_paste();
+			ev.type = EV_PASTE;
+			ev.text = paste.buf;
+			ev.len = paste.len;
+			return ev;
+		}
+		/* nothing follows: the escape key itself */
+		if(tui_peek(0) == -1) {
+			ev.type = EV_KEY;
+			ev.key = c;
+			return ev;
+		}
 		ev.type = EV_UKN;
 		return ev;
 	}
@@ -464,6 +902,13 @@ tui_next_event(void) {
 	return ev;
 }
 
+/* safe to call from any thread */
+void
+tui_wakeup(void) {
+	if(wake_pipe[1] != -1)
+		write(wake_pipe[1], "", 1);
+}
+
 UI ui_tui = {
 	.name = "TUI",
 	.init = tui_init,
@@ -472,9 +917,13 @@ UI ui_tui = {
 	.frame_flush = tui_frame_flush,
 	.text_width = tui_text_width,
 	.text_len = tui_text_len,
-	.move_cursor = tui_move_cursor,
+	.text_run = tui_text_run,
+	.move_cursor = tui_place_cursor,
 	.draw_line = tui_draw_line,
 	.draw_symbol = tui_draw_symbol,
+	.scroll = tui_scroll,
 	.get_window_size = tui_get_window_size,
-	.next_event = tui_next_event
+	.next_event = tui_next_event,
+	.pending = tui_pending,
+	.wakeup = tui_wakeup
 };
@@ -10,6 +10,8 @@ typedef enum {
 
 typedef enum {
 	EV_KEY,
+	EV_PASTE,
+	EV_WAKE,
 	EV_UKN
 } EventType;
 
@@ -19,6 +21,8 @@ typedef struct {
 	int mod;
 	int row;
 	int col;
+	char *text; /* EV_PASTE payload, valid until the next event */
+	size_t len;
 } Event;
 
 typedef struct {
@@ -30,7 +34,19 @@ typedef struct {
 enum CellFlags {
 	CELL_DEFAULT,
 	CELL_TRUNC_L,
-	CELL_TRUNC_R
+	CELL_TRUNC_R,
+	CELL_MATCH = 4 /* part of a search match */
+};
+
+/* syntax class of the text, drawn in its own color */
+enum CellAttr {
+	ATTR_NONE,
+	ATTR_KEYWORD,
+	ATTR_TYPE,
+	ATTR_STRING,
+	ATTR_NUMBER,
+	ATTR_COMMENT,
+	ATTR_PREPROC
 };
 
 #define CELL_POOL_THRESHOLD 8
@@ -41,26 +57,33 @@ typedef struct {
 	} data;
 	uint16_t len;
 	uint16_t width;
-	int flags;
+	uint16_t flags;
+	uint16_t attr;
 } Cell;
 
 typedef struct UI UI;
 struct UI {
 	const char *name;
 	TextPool pool;
+	size_t written; /* frame bytes sent out so far */
 	void (*init)(void);
 	void (*exit)(void);
 	void (*frame_start)(void);
 	void (*frame_flush)(void);
 	int (*text_width)(char *s, int len, int x);
 	int (*text_len)(char *s, int len);
+	int (*text_run)(char *s, int len);
 	void (*move_cursor)(int x, int y);
 	void (*draw_line)(UI *ui, int x, int y, Cell *cells, int count);
 	void (*draw_symbol)(int r, int c, Symbol sym);
+	void (*scroll)(int top, int bottom, int n); /* n > 0 moves rows up */
 	void (*get_window_size)(int *rows, int *cols);
 	Event (*next_event)(void);
+	int (*pending)(void);
+	void (*wakeup)(void);
 };
 
 extern UI ui_tui;
+extern UI ui_null;
 
 #endif
@@ -1,20 +1,56 @@
-#define _XOPEN_SOURCE
-#include <wchar.h>
 #include <grapheme.h>
-#include <utf8proc.h>
+#include <string.h>
 
 #include "utf8.h"
+#include "width.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+int ascii_run_scalar(char *buf, int len);
+#ifdef HAVE_X86
+int ascii_run_sse2(char *buf, int len);
+int ascii_run_avx2(char *buf, int len);
+#endif
+int find_scalar(char *buf, int len, char *q, int qlen);
+#ifdef HAVE_X86
+int find_sse2(char *buf, int len, char *q, int qlen);
+int find_avx2(char *buf, int len, char *q, int qlen);
+#endif
+
+/* set by utf8_init() before any other thread runs */
+int (*ascii_run)(char *buf, int len) = ascii_run_scalar;
+int (*find)(char *buf, int len, char *q, int qlen) = find_scalar;
+
+/* pick the best implementations for this cpu */
+void
+utf8_init(void) {
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		ascii_run = ascii_run_avx2;
+		find = find_avx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		ascii_run = ascii_run_sse2;
+		find = find_sse2;
+	}
+#endif
+}
 
 size_t
 utf8_len_compat(char *buf, int len) {
 	uint_least32_t cp;
-	int step, i;
+	int step, i, p;
 
 	i = step = utf8_decode(buf, len, &cp);
-	if(!utf8_is_combining(cp) && wcwidth(cp) < 0) return step;
+	p = utf8_prop(cp);
+	if(!(p & UTF8_COMBINING) && UTF8_WIDTH(p) < 0) return step;
 	while(i < len) {
 		step = utf8_decode(buf + i, len - i, &cp);
-		if(!utf8_is_combining(cp) || wcwidth(cp)) break;
+		p = utf8_prop(cp);
+		if(!(p & UTF8_COMBINING) || UTF8_WIDTH(p)) break;
 		i += step;
 	}
 	return i;
@@ -32,8 +68,124 @@ utf8_decode(char *buf, int len, unsigned int *cp) {
 
 int
 utf8_is_combining(unsigned int cp) {
-	const utf8proc_property_t *prop = utf8proc_get_property(cp);
+	return utf8_prop(cp) & UTF8_COMBINING;
+}
+
+/* length of the leading run of printable ASCII (no tabs or controls) */
+int
+utf8_ascii_run(char *buf, int len) {
+	return ascii_run(buf, len);
+}
+
+/* Offset of the first occurrence of q in buf, -1 if none. Matching bytes
+ * is enough, UTF-8 never matches in the middle of a character. */
+int
+utf8_find(char *buf, int len, char *q, int qlen) {
+	char *p;
+
+	if(qlen > len)
+		return -1;
+	if(qlen == 1)
+		return (p = memchr(buf, *q, len)) ? p - buf : -1;
+	return find(buf, len, q, qlen);
+}
+
+int
+ascii_run_scalar(char *buf, int len) {
+	int i;
+
+	for(i = 0; i < len; i++)
+		if(buf[i] < 0x20 || buf[i] > 0x7e)
+			break;
+	return i;
+}
+
+#ifdef HAVE_X86
+/* printable ASCII is 0x20..0x7e, bytes >= 0x80 are negative as signed */
+__attribute__((target("sse2")))
+int
+ascii_run_sse2(char *buf, int len) {
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	__m128i v;
+	int i, m;
 
-	return (prop->category == UTF8PROC_CATEGORY_MN
-			|| prop->category == UTF8PROC_CATEGORY_ME);
+	for(i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((__m128i *)(buf + i));
+		m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+		if(m != 0xffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + ascii_run_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+int
+ascii_run_avx2(char *buf, int len) {
+	const __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+	__m256i v;
+	unsigned int m;
+	int i;
+
+	for(i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((__m256i *)(buf + i));
+		m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v)));
+		if(m != 0xffffffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + ascii_run_sse2(buf + i, len - i);
+}
+#endif
+
+int
+find_scalar(char *buf, int len, char *q, int qlen) {
+	char *p = buf, *end = buf + len - qlen + 1;
+
+	for(; p < end && (p = memchr(p, *q, end - p)); p++)
+		if(!memcmp(p + 1, q + 1, qlen - 1))
+			return p - buf;
+	return -1;
+}
+
+#ifdef HAVE_X86
+/* Candidates are the positions where both the first and the last byte of
+ * q match, only those get compared in full. */
+__attribute__((target("sse2")))
+int
+find_sse2(char *buf, int len, char *q, int qlen) {
+	const __m128i first = _mm_set1_epi8(q[0]), last = _mm_set1_epi8(q[qlen - 1]);
+	__m128i a, b;
+	unsigned int m;
+	int i, r;
+
+	for(i = 0; i + qlen - 1 + 16 <= len; i += 16) {
+		a = _mm_loadu_si128((__m128i *)(buf + i));
+		b = _mm_loadu_si128((__m128i *)(buf + i + qlen - 1));
+		m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for(; m; m &= m - 1)
+			if(!memcmp(buf + i + __builtin_ctz(m) + 1, q + 1, qlen - 2))
+				return i + __builtin_ctz(m);
+	}
+	r = find_scalar(buf + i, len - i, q, qlen);
+	return r == -1 ? -1 : i + r;
+}
+
+__attribute__((target("avx2")))
+int
+find_avx2(char *buf, int len, char *q, int qlen) {
+	const __m256i first = _mm256_set1_epi8(q[0]), last = _mm256_set1_epi8(q[qlen - 1]);
+	__m256i a, b;
+	unsigned int m;
+	int i, r;
+
+	for(i = 0; i + qlen - 1 + 32 <= len; i += 32) {
+		a = _mm256_loadu_si256((__m256i *)(buf + i));
+		b = _mm256_loadu_si256((__m256i *)(buf + i + qlen - 1));
+		m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for(; m; m &= m - 1)
+			if(!memcmp(buf + i + __builtin_ctz(m) + 1, q + 1, qlen - 2))
+				return i + __builtin_ctz(m);
+	}
+	r = find_sse2(buf + i, len - i, q, qlen);
+	return r == -1 ? -1 : i + r;
 }
+#endif
@@ -12,7 +12,25 @@
 /* Zero-Width Non-Joiner */
 #define ZWNJ "\xe2\x80\x8c"
 
+/* codepoint properties, see mkwidth.c: the low two bits hold the
+ * wcwidth()-like width plus one */
+#define UTF8_COMBINING	(1 << 2)
+#define UTF8_CMOD	(1 << 3)
+#define UTF8_RIS	(1 << 4)
+#define UTF8_VAR	(1 << 5)
+#define UTF8_VS16W	(1 << 6)
+#define UTF8_WIDTH(p)	(((p) & 3) - 1)
+
+extern const unsigned short utf8_prop_index[];
+extern const unsigned char utf8_prop_blocks[][256];
+
+#define utf8_prop(cp) ((cp) < 0x110000 \
+	? utf8_prop_blocks[utf8_prop_index[(cp) >> 8]][(cp) & 0xff] : 0)
+
+void utf8_init(void);
 int utf8_len(char *buf, int len);
 size_t utf8_len_compat(char *buf, int len);
 int utf8_decode(char *buf, int len, unsigned int *cp);
 int utf8_is_combining(unsigned int cp);
+int utf8_ascii_run(char *buf, int len);
+int utf8_find(char *buf, int len, char *q, int qlen);